@@ -27,8 +27,8 @@
 //#define ADC_VREF	        3300
 
 // GPIO config
-//#define GPIO_USE_IRQS
-//#define GPIO_IRQ0_ENABLE
+#define GPIO_USE_IRQS
+#define GPIO_IRQ7_ENABLE
 
 // TIM config
 //#define TIM_USE_IRQS
@@ -64,20 +64,55 @@
 // USB config
 #define USB_ENABLE
 #define USB_CLASS_COMPOSITE
-#define USB_CDC_BFR_SIZE		256
+// PORT(index, rx buffer, tx buffer): Console, Modem, Aux
+#define USB_CDC_PORTS(PORT)		PORT(0, 128, 256) PORT(1, 1024, 1024) PORT(2, 256, 256)
+// Ports that send full 64 byte packets by default. Windows hosts need 63 byte packets.
+//#define USB_CDC_FULL_PACKET_PORTS	((1 << 1) | (1 << 2))
+// Vendor bulk interface (WinUSB/libusb). This carries the bridge streams alongside the CDC ports.
+// There are no MS OS 2.0 descriptors, as the USB driver cannot serve a BOS. Windows needs WinUSB bound by hand.
+//#define USB_VENDOR_ENABLE
+// CHANNEL(index, rx buffer, tx buffer): Modem, Aux
+#define USB_VENDOR_CHANNELS(CHANNEL)	CHANNEL(0, 1024, 1024) CHANNEL(1, 256, 256)
 
 // TSC config
 //#define TSC_ENABLE
 //#define TSC_AF					GPIO_AF3_TSC
 
 #define MODEM_UART			UART_2
+#define MODEM_UART_TX		PA2
+#define MODEM_UART_RX		PA3
+#define MODEM_UART_AF		UART2_AF
+// Optional hardware flow control, enabled with UART:MODem:FLOW while the bridge is closed.
+// UART:MODem:FLOW ON is an error unless these are defined.
+// PA0 and PA1 are ADC_IN0 and COMP1_INP in the .ioc, and are not routed to the modem on this board.
+// Only define these for a board that wires them to the modem CTS and RTS.
+//#define MODEM_UART_CTS		PA0
+//#define MODEM_UART_RTS		PA1
 #define MODEM_WAKE			PA4
 #define MODEM_RESET			PA5
 #define MODEM_DTR			PA6
 #define MODEM_DCD			PA7
 #define MODEM_PWR_EN		PB0
 
+#define MODEM_CDC_INDEX		1
+#define MODEM_VENDOR_CHANNEL	0
+#define MODEM_DTR_FOLLOWS_CDC
+// Turn the modem off while USB is suspended. Otherwise it is left powered.
+//#define MODEM_SUSPEND_RELEASE_POWER
+
 #define AUX_UART			UART_3
+#define AUX_UART_TX			PB10
+#define AUX_UART_RX			PB11
+#define AUX_UART_AF			UART3_AF
+#define AUX_CDC_INDEX		2
+#define AUX_VENDOR_CHANNEL	1
+
+// Bridge data on the CDC ports is moved by the USART interrupts, so it does not wait on the main loop.
+#define BRIDGE_FORWARD_IRQ
+// Bridge receive is stored by circular DMA, and flushed to the port on idle line. Otherwise each byte is an interrupt.
+#define BRIDGE_RX_DMA
+// Bridge transmit is sent by DMA straight from the CDC buffer. Otherwise each byte is an interrupt.
+#define BRIDGE_TX_DMA
 
 #define LED_R_PIN			PB5
 #define LED_G_PIN			PB4
@@ -94,5 +129,8 @@
 #define CONSOLE_TX_BFR		64
 #define CONSOLE_RX_BFR		64
 
+// Long enough for the USB:STATistics? reply.
+#define SCPI_REPLY_MAX		160
+
 
 #endif /* BOARD_H */
@@ -0,0 +1,227 @@
+
+#include "Updater.h"
+
+// The resident boot. This is linked into the boot region, and is never replaced by an update.
+// It runs before the application startup, so it must not use .data, .bss, or any code outside this file.
+
+/*
+ * PRIVATE DEFINITIONS
+ */
+
+#define BOOT_CODE					__attribute__((section(".boot"), optimize("no-tree-loop-distribute-patterns")))
+#define BOOT_FLASH_ERRORS			(FLASH_SR_PGERR | FLASH_SR_WRPRTERR)
+
+// The ST system bootloader. This supports DFU, so a board without a valid application can still be recovered.
+#define BOOT_SYSTEM_BASE			0x1FFFC800
+#define BOOT_MEM_MODE_SYSTEM		SYSCFG_CFGR1_MEM_MODE_0
+
+/*
+ * PRIVATE TYPES
+ */
+
+/*
+ * PRIVATE PROTOTYPES
+ */
+
+static void Boot_Reset(void);
+static void Boot_Fault(void);
+static bool Boot_IsStaged(const Updater_Header_t * header);
+static uint32_t Boot_CountAttempt(void);
+static Updater_Status_t Boot_Install(const Updater_Header_t * header);
+static bool Boot_ProgramHalfword(uint32_t address, uint16_t value);
+static bool Boot_IsValid(uint32_t base, uint32_t size);
+static void Boot_Start(uint32_t base);
+static void Boot_StartSystem(void);
+static bool Boot_WaitIdle(void);
+static uint32_t Boot_CRC(uint32_t address, uint32_t size);
+
+/*
+ * PRIVATE VARIABLES
+ */
+
+extern uint32_t _estack;
+
+// Only the reset and fault vectors are needed. The application maps its own table over these.
+__attribute__((section(".boot_vector"), used))
+static void (* const cBoot_Vectors[])(void) = {
+	(void (*)(void))&_estack,
+	Boot_Reset,
+	Boot_Fault,		// NMI
+	Boot_Fault,		// HardFault
+};
+
+/*
+ * PRIVATE FUNCTIONS
+ */
+
+BOOT_CODE static void Boot_Reset(void)
+{
+	const Updater_Header_t * header = (const Updater_Header_t *)UPDATER_HEADER_BASE;
+	if (Boot_IsStaged(header))
+	{
+		// Once the install has failed too often, it is abandoned. The application is started below if it is
+		// still valid, and can report the failed stage and stage the image again.
+		uint32_t attempt = Boot_CountAttempt();
+		if (attempt < UPDATER_INSTALL_ATTEMPTS)
+		{
+			Updater_Status_t status = Boot_Install(header);
+			if (status != Updater_Status_Ok)
+			{
+				// The header is still valid, so the install is retried from the start.
+				Boot_ProgramHalfword(UPDATER_RESULTS_BASE + (attempt * 2), status);
+				SCB->AIRCR = (0x5FA << SCB_AIRCR_VECTKEY_Pos) | SCB_AIRCR_SYSRESETREQ_Msk;
+				while (1);
+			}
+		}
+	}
+
+	if (Boot_IsValid(UPDATER_APP_BASE, UPDATER_APP_SIZE))
+	{
+		Boot_Start(UPDATER_APP_BASE);
+	}
+	Boot_StartSystem();
+}
+
+BOOT_CODE static void Boot_Fault(void)
+{
+	while (1);
+}
+
+BOOT_CODE static bool Boot_IsStaged(const Updater_Header_t * header)
+{
+	return header->magic == UPDATER_MAGIC
+		&& header->check == ~UPDATER_MAGIC
+		&& header->size <= UPDATER_APP_SIZE
+		&& Boot_IsValid(UPDATER_IMAGE_BASE, header->size)
+		&& Boot_CRC(UPDATER_IMAGE_BASE, header->size) == header->crc;
+}
+
+BOOT_CODE static uint32_t Boot_CountAttempt(void)
+{
+	// Returns the attempt being made, or UPDATER_INSTALL_ATTEMPTS once they are used up.
+	const volatile uint16_t * attempts = (const volatile uint16_t *)UPDATER_ATTEMPTS_BASE;
+	for (uint32_t i = 0; i < UPDATER_INSTALL_ATTEMPTS; i++)
+	{
+		if (attempts[i] == 0xFFFF)
+		{
+			// If the count cannot be kept, the attempt is not made.
+			return Boot_ProgramHalfword(UPDATER_ATTEMPTS_BASE + (i * 2), 0) ? i : UPDATER_INSTALL_ATTEMPTS;
+		}
+	}
+	return UPDATER_INSTALL_ATTEMPTS;
+}
+
+BOOT_CODE static Updater_Status_t Boot_Install(const Updater_Header_t * header)
+{
+	FLASH->KEYR = FLASH_KEY1;
+	FLASH->KEYR = FLASH_KEY2;
+
+	Updater_Status_t status = Updater_Status_Ok;
+	for (uint32_t page = 0; page < header->size && status == Updater_Status_Ok; page += UPDATER_PAGE_SIZE)
+	{
+		FLASH->CR |= FLASH_CR_PER;
+		FLASH->AR = UPDATER_APP_BASE + page;
+		FLASH->CR |= FLASH_CR_STRT;
+		bool success = Boot_WaitIdle();
+		FLASH->CR &= ~FLASH_CR_PER;
+		if (!success)
+		{
+			status = Updater_Status_Erase;
+			break;
+		}
+
+		const volatile uint16_t * src = (const volatile uint16_t *)(UPDATER_IMAGE_BASE + page);
+		volatile uint16_t * dst = (volatile uint16_t *)(UPDATER_APP_BASE + page);
+		uint32_t count = header->size - page;
+		if (count > UPDATER_PAGE_SIZE) { count = UPDATER_PAGE_SIZE; }
+
+		FLASH->CR |= FLASH_CR_PG;
+		for (uint32_t i = 0; i < count / 2 && success; i++)
+		{
+			dst[i] = src[i];
+			success = Boot_WaitIdle();
+		}
+		FLASH->CR &= ~FLASH_CR_PG;
+		if (!success)
+		{
+			status = Updater_Status_Program;
+		}
+	}
+
+	// The staged image is only discarded once the installed copy checks out.
+	if (status == Updater_Status_Ok && Boot_CRC(UPDATER_APP_BASE, header->size) != header->crc)
+	{
+		status = Updater_Status_Verify;
+	}
+	if (status == Updater_Status_Ok)
+	{
+		FLASH->CR |= FLASH_CR_PER;
+		FLASH->AR = UPDATER_HEADER_BASE;
+		FLASH->CR |= FLASH_CR_STRT;
+		if (!Boot_WaitIdle())
+		{
+			status = Updater_Status_Erase;
+		}
+		FLASH->CR &= ~FLASH_CR_PER;
+	}
+
+	FLASH->CR |= FLASH_CR_LOCK;
+	return status;
+}
+
+BOOT_CODE static bool Boot_ProgramHalfword(uint32_t address, uint16_t value)
+{
+	FLASH->KEYR = FLASH_KEY1;
+	FLASH->KEYR = FLASH_KEY2;
+	FLASH->CR |= FLASH_CR_PG;
+	*(volatile uint16_t *)address = value;
+	bool success = Boot_WaitIdle();
+	FLASH->CR &= ~FLASH_CR_PG;
+	FLASH->CR |= FLASH_CR_LOCK;
+	return success;
+}
+
+BOOT_CODE static bool Boot_IsValid(uint32_t base, uint32_t size)
+{
+	// The vector table must hold a stack in RAM, and a reset handler in the application region.
+	const uint32_t * vectors = (const uint32_t *)base;
+	uint32_t sp = vectors[0];
+	uint32_t pc = vectors[1] & ~1;
+	return sp > UPDATER_RAM_BASE && sp <= UPDATER_RAM_END
+		&& pc >= UPDATER_APP_BASE && pc < UPDATER_APP_BASE + size;
+}
+
+BOOT_CODE static void Boot_Start(uint32_t base)
+{
+	const uint32_t * vectors = (const uint32_t *)base;
+	__set_MSP(vectors[0]);
+	((void (*)(void))vectors[1])();
+	while (1);
+}
+
+BOOT_CODE static void Boot_StartSystem(void)
+{
+	RCC->APB2ENR |= RCC_APB2ENR_SYSCFGEN;
+	SYSCFG->CFGR1 = (SYSCFG->CFGR1 & ~SYSCFG_CFGR1_MEM_MODE) | BOOT_MEM_MODE_SYSTEM;
+	Boot_Start(BOOT_SYSTEM_BASE);
+}
+
+BOOT_CODE static bool Boot_WaitIdle(void)
+{
+	while (FLASH->SR & FLASH_SR_BSY);
+	uint32_t sr = FLASH->SR;
+	FLASH->SR = sr & (BOOT_FLASH_ERRORS | FLASH_SR_EOP);
+	return !(sr & BOOT_FLASH_ERRORS);
+}
+
+BOOT_CODE static uint32_t Boot_CRC(uint32_t address, uint32_t size)
+{
+	RCC->AHBENR |= RCC_AHBENR_CRCEN;
+	CRC->CR = CRC_CR_RESET;
+	const uint32_t * words = (const uint32_t *)address;
+	for (uint32_t i = 0; i < size / 4; i++)
+	{
+		CRC->DR = words[i];
+	}
+	return CRC->DR;
+}
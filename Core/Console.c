@@ -9,6 +9,7 @@
 #ifdef CONSOLE_USB
 #include "USB.h"
 #include "USB_CDCX.h"
+#include "Core.h"
 #endif
 
 /*
@@ -23,6 +24,10 @@
 #define CONSOLE_TX_BFR		128
 #endif
 
+#ifndef CONSOLE_USB_TIMEOUT
+#define CONSOLE_USB_TIMEOUT	10
+#endif
+
 /*
  * PRIVATE TYPES
  */
@@ -182,7 +187,25 @@ void Console_Write(const uint8_t * bfr, uint32_t size)
 	UART_Write(CONSOLE_UART, bfr, size);
 #endif
 #ifdef CONSOLE_USB
-	USB_CDCX_Write(CONSOLE_CDC_INDEX, bfr, size);
+	if (!USB_CDCX_IsOpen(CONSOLE_CDC_INDEX))
+	{
+		// Nobody is listening, so there is nothing to wait for.
+		return;
+	}
+	// The CDC write does not block, so we wait here for the buffer to drain.
+	// Abort if it does not come free.
+	uint32_t tide = CORE_GetTick();
+	while (1)
+	{
+		uint32_t written = USB_CDCX_Write(CONSOLE_CDC_INDEX, bfr, size);
+		bfr += written;
+		size -= written;
+		if (size == 0 || CORE_GetTick() - tide > CONSOLE_USB_TIMEOUT)
+		{
+			break;
+		}
+		CORE_Idle();
+	}
 #endif
 }
 
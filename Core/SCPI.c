@@ -90,11 +90,16 @@ void SCPI_Parse(SCPI_t * scpi, const uint8_t * data, uint32_t size)
 // Command handlers: Output
 void SCPI_Reply_Printf(SCPI_t * scpi, const char * fmt, ...)
 {
-	char bfr[SCPI_BUFFER_SIZE];
+	char bfr[SCPI_REPLY_MAX + 3];
 	va_list va;
 	va_start(va, fmt);
-	uint32_t size = vsnprintf(bfr, sizeof(bfr)-3, fmt, va);
+	uint32_t size = vsnprintf(bfr, SCPI_REPLY_MAX + 1, fmt, va);
 	va_end(va);
+	if (size > SCPI_REPLY_MAX)
+	{
+		// The reply was truncated.
+		size = SCPI_REPLY_MAX;
+	}
 	bfr[size++] = '\r';
 	bfr[size++] = '\n';
 	bfr[size] = 0;
@@ -240,6 +245,16 @@ static bool SCPI_ParseLine(SCPI_t * scpi, char * str)
 				// This is a properly formatted query command.
 				return node->func(scpi, NULL);
 			}
+			else if (!can_run)
+			{
+				// Query only nodes may take arguments.
+				SCPI_Arg_t args[SCPI_ARGS_MAX];
+				bzero(args, sizeof(args));
+				if (SCPI_ParseArguments(args, pattern, &str) && *str == 0)
+				{
+					return node->func(scpi, args);
+				}
+			}
 		}
 	}
 	else
@@ -11,7 +11,11 @@
 #define SCPI_BUFFER_SIZE	128
 #endif
 #ifndef SCPI_ARGS_MAX
-#define SCPI_ARGS_MAX		4
+#define SCPI_ARGS_MAX		5
+#endif
+// The longest reply, not including the line ending. Longer replies are truncated.
+#ifndef SCPI_REPLY_MAX
+#define SCPI_REPLY_MAX		(SCPI_BUFFER_SIZE - 4)
 #endif
 
 #define SCPI_ARG_BOOL		'b'
@@ -0,0 +1,819 @@
+#include "UARTX.h"
+#include "USB_CDCX.h"
+#include "Updater.h"
+#include "CLK.h"
+
+/*
+ * PRIVATE DEFINITIONS
+ */
+
+#define USART_CR1_FRAMING		(USART_CR1_M0 | USART_CR1_M1 | USART_CR1_PCE | USART_CR1_PS)
+
+// DMA uses the default channel mapping. The remap bits in SYSCFG are left clear.
+#define UARTX_DMA_IRQn			DMA1_Channel4_5_6_7_IRQn
+#define UARTX_DMA_FLAGS(ch)		(DMA_IFCR_CGIF1 << (4 * ((ch) - 1)))
+
+/*
+ * PRIVATE TYPES
+ */
+
+typedef struct {
+	UART_t * uart;				// NULL while detached
+	VoidFunction_t previous;	// The UART driver handler, restored on detach
+	uint8_t port;
+	uint8_t mask;
+	volatile bool hold;			// Transmit is paused for a break
+	volatile uint8_t errors;	// UARTX_Error_t latched by the interrupt
+	DMA_Channel_TypeDef * rxDma;	// NULL unless in RxDMA mode
+	uint32_t rxFlags;
+	uint32_t rxTail;			// The next byte in the buffer to be flushed
+	DMA_Channel_TypeDef * txDma;	// NULL unless in TxDMA mode
+	uint32_t txFlags;
+	uint32_t txCount;			// The span of the port being sent. It is consumed once the transfer completes.
+	GPIO_Pin_t rts;
+	uint32_t rtsAf;
+	uint32_t rtsHeadroom;		// Zero unless RTS is held from the receive interrupt
+	volatile bool rtsHeld;		// Held by the receive interrupt, and not yet polled
+	uint8_t rxBfr[UARTX_RX_DMA_SIZE];
+} UARTX_Link_t;
+
+typedef struct {
+	DMA_Channel_TypeDef * rx;
+	uint32_t rxNumber;
+	DMA_Channel_TypeDef * tx;
+	uint32_t txNumber;
+} UARTX_LinkDMA_t;
+
+/*
+ * PRIVATE PROTOTYPES
+ */
+
+static bool UARTX_EncodeFraming(const UARTX_Framing_t * framing, uint32_t * cr1, uint32_t * cr2);
+static bool UARTX_EncodeBaud(uint32_t clock, uint32_t baud, uint32_t * brr, uint32_t * cr1);
+static int32_t UARTX_LinkIndex(UART_t * uart);
+static void UARTX_Kick(uint8_t port);
+static void UARTX_Reset(uint8_t port);
+static void UARTX_StartTransmit(UARTX_Link_t * link);
+static void UARTX_ClaimDMA(void);
+static void UARTX_ReleaseDMA(void);
+static void UARTX_StartReceiveDMA(UARTX_Link_t * link, int32_t index);
+static void UARTX_StopReceiveDMA(UARTX_Link_t * link);
+static void UARTX_FlushReceive(UARTX_Link_t * link);
+static void UARTX_CheckHeadroom(UARTX_Link_t * link);
+static void UARTX_StartTransmitDMA(UARTX_Link_t * link, int32_t index);
+static void UARTX_StopTransmitDMA(UARTX_Link_t * link);
+static void UARTX_NextTransmitDMA(UARTX_Link_t * link);
+
+static void UARTX_IRQHandler(UARTX_Link_t * link);
+static void UARTX_USART1_IRQHandler(void);
+static void UARTX_USART2_IRQHandler(void);
+static void UARTX_USART3_4_IRQHandler(void);
+static void UARTX_DMA_IRQHandler(void);
+
+/*
+ * PRIVATE VARIABLES
+ */
+
+const UARTX_Framing_t cUARTX_Framing_8N1 = {
+	.data_bits = 8,
+	.parity = UARTX_Parity_None,
+	.stop_bits = UARTX_StopBits_1,
+};
+
+static UARTX_Link_t gLinks[UARTX_LINK_COUNT];
+
+static const IRQn_Type cUARTX_LinkIRQn[UARTX_LINK_COUNT] = {
+	USART1_IRQn,
+	USART2_IRQn,
+	USART3_4_IRQn,
+};
+
+static const VoidFunction_t cUARTX_LinkHandlers[UARTX_LINK_COUNT] = {
+	UARTX_USART1_IRQHandler,
+	UARTX_USART2_IRQHandler,
+	UARTX_USART3_4_IRQHandler,
+};
+
+// USART1 is on channels 2 and 3, which do not share the interrupt with the others.
+static const UARTX_LinkDMA_t cUARTX_LinkDMA[UARTX_LINK_COUNT] = {
+	{ NULL, 0, NULL, 0 },
+	{ DMA1_Channel5, 5, DMA1_Channel4, 4 },
+	{ DMA1_Channel6, 6, DMA1_Channel7, 7 },
+};
+
+static struct {
+	VoidFunction_t previous;	// Restored once no link uses DMA
+	uint32_t users;
+} gDMA;
+
+/*
+ * PUBLIC FUNCTIONS
+ */
+
+bool UARTX_Init(UART_t * uart, uint32_t baud, const UARTX_Framing_t * framing)
+{
+	uint32_t cr1;
+	uint32_t cr2;
+	uint32_t brr;
+	uint32_t over8;
+	// USART2 and USART3 are clocked from PCLK. USART1 is left on its reset source, which is also PCLK.
+	if (!UARTX_EncodeFraming(framing, &cr1, &cr2)
+		|| !UARTX_EncodeBaud(CLK_GetPCLKFreq(), baud, &brr, &over8))
+	{
+		return false;
+	}
+
+	UART_Init(uart, baud, UART_Mode_Default);
+
+	// The framing and baud can only be written while the USART is disabled.
+	USART_TypeDef * usart = uart->Instance;
+	usart->CR1 &= ~USART_CR1_UE;
+	usart->CR1 = (usart->CR1 & ~(USART_CR1_FRAMING | USART_CR1_OVER8)) | cr1 | over8;
+	usart->CR2 = (usart->CR2 & ~(USART_CR2_STOP | USART_CR2_ABREN | USART_CR2_ABRMODE)) | cr2;
+	usart->BRR = brr;
+	usart->CR1 |= USART_CR1_UE;
+	return true;
+}
+
+bool UARTX_StartAutoBaud(UART_t * uart, uint32_t baud)
+{
+	if (!UARTX_Init(uart, baud, &cUARTX_Framing_8N1))
+	{
+		return false;
+	}
+
+	// Mode 1 times the start bit and bit 0 together, from one falling edge to the next.
+	USART_TypeDef * usart = uart->Instance;
+	usart->CR1 &= ~USART_CR1_UE;
+	usart->CR2 |= USART_CR2_ABREN | USART_CR2_ABRMODE_0;
+	usart->CR1 |= USART_CR1_UE;
+	return true;
+}
+
+uint32_t UARTX_PollAutoBaud(UART_t * uart)
+{
+	USART_TypeDef * usart = uart->Instance;
+	uint32_t isr = usart->ISR;
+	if (!(isr & USART_ISR_ABRF))
+	{
+		return 0;
+	}
+	if (isr & USART_ISR_ABRE)
+	{
+		usart->RQR = USART_RQR_ABRRQ;
+		return 0;
+	}
+
+	// The hardware has written BRR. This is decoded the same way it was encoded.
+	uint32_t brr = usart->BRR;
+	uint32_t clock = CLK_GetPCLKFreq();
+	usart->CR1 &= ~USART_CR1_UE;
+	usart->CR2 &= ~(USART_CR2_ABREN | USART_CR2_ABRMODE);
+	usart->CR1 |= USART_CR1_UE;
+	if (usart->CR1 & USART_CR1_OVER8)
+	{
+		return (2 * clock) / ((brr & 0xFFF0) | ((brr & 0x0007) << 1));
+	}
+	return clock / brr;
+}
+
+uint8_t UARTX_DataMask(const UARTX_Framing_t * framing)
+{
+	return framing->data_bits == 7 ? 0x7F : 0xFF;
+}
+
+bool UARTX_SetBreak(UART_t * uart, GPIO_Pin_t tx, uint32_t af, bool enable)
+{
+	int32_t index = UARTX_LinkIndex(uart);
+	UARTX_Link_t * link = (index >= 0 && gLinks[index].uart) ? gLinks + index : NULL;
+	if (link)
+	{
+		// An attached link stops taking data from the port, so the break can follow the data ahead of it.
+		link->hold = enable;
+		if (!enable)
+		{
+			UARTX_StartTransmit(link);
+		}
+	}
+
+	if (enable)
+	{
+		// TC is only set once the last frame has left the shift register.
+		if (!(uart->Instance->ISR & USART_ISR_TC))
+		{
+			return false;
+		}
+		GPIO_EnableOutput(tx, GPIO_PIN_RESET);
+	}
+	else
+	{
+		GPIO_EnableAlternate(tx, GPIO_Flag_None, af);
+	}
+	return true;
+}
+
+void UARTX_SetFlowControl(UART_t * uart, GPIO_Pin_t cts, GPIO_Pin_t rts, uint32_t af, bool enable)
+{
+	// The flow control bits can only be written while the USART is disabled.
+	USART_TypeDef * usart = uart->Instance;
+	usart->CR1 &= ~USART_CR1_UE;
+	if (enable)
+	{
+		usart->CR3 |= USART_CR3_CTSE | USART_CR3_RTSE;
+		GPIO_EnableAlternate(cts | rts, GPIO_Flag_None, af);
+	}
+	else
+	{
+		usart->CR3 &= ~(USART_CR3_CTSE | USART_CR3_RTSE);
+		GPIO_Deinit(cts | rts);
+	}
+	usart->CR1 |= USART_CR1_UE;
+}
+
+void UARTX_HoldRTS(GPIO_Pin_t rts, uint32_t af, bool hold)
+{
+	// The USART only raises RTS once its data register is full, which DMA never allows.
+	if (hold)
+	{
+		GPIO_EnableOutput(rts, GPIO_PIN_SET);
+	}
+	else
+	{
+		GPIO_EnableAlternate(rts, GPIO_Flag_None, af);
+	}
+}
+
+void UARTX_SetRTSHeadroom(UART_t * uart, GPIO_Pin_t rts, uint32_t af, uint32_t headroom)
+{
+	int32_t index = UARTX_LinkIndex(uart);
+	if (index < 0)
+	{
+		return;
+	}
+	UARTX_Link_t * link = gLinks + index;
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	link->rts = rts;
+	link->rtsAf = af;
+	link->rtsHeadroom = headroom;
+	link->rtsHeld = false;
+	__set_PRIMASK(primask);
+}
+
+bool UARTX_PollRTSHold(UART_t * uart)
+{
+	int32_t index = UARTX_LinkIndex(uart);
+	if (index < 0 || !gLinks[index].rtsHeld)
+	{
+		return false;
+	}
+	gLinks[index].rtsHeld = false;
+	return true;
+}
+
+UARTX_Error_t UARTX_PollErrors(UART_t * uart, GPIO_Pin_t rx)
+{
+	USART_TypeDef * usart = uart->Instance;
+	uint32_t isr = usart->ISR;
+	uint32_t icr = 0;
+	UARTX_Error_t errors = UARTX_Error_None;
+
+	// Attached links latch their errors in the interrupt, where a break can be caught reliably.
+	int32_t index = UARTX_LinkIndex(uart);
+	if (index >= 0 && gLinks[index].uart)
+	{
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		errors = gLinks[index].errors;
+		gLinks[index].errors = UARTX_Error_None;
+		__set_PRIMASK(primask);
+		return errors;
+	}
+
+	if (isr & USART_ISR_FE)
+	{
+		errors |= UARTX_Error_Framing;
+		if (GPIO_Read(rx) == GPIO_PIN_RESET)
+		{
+			errors |= UARTX_Error_Break;
+		}
+		icr |= USART_ICR_FECF;
+	}
+	if (isr & USART_ISR_PE)
+	{
+		errors |= UARTX_Error_Parity;
+		icr |= USART_ICR_PECF;
+	}
+	if (isr & USART_ISR_ORE)
+	{
+		errors |= UARTX_Error_Overrun;
+		icr |= USART_ICR_ORECF;
+	}
+
+	// Only the flags that were seen are cleared, so none are missed.
+	usart->ICR = icr;
+
+	// Errors latched by a link that has since detached are still reported.
+	if (index >= 0 && gLinks[index].errors)
+	{
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		errors |= gLinks[index].errors;
+		gLinks[index].errors = UARTX_Error_None;
+		__set_PRIMASK(primask);
+	}
+	return errors;
+}
+
+bool UARTX_Attach(UART_t * uart, uint8_t port, uint8_t mask, UARTX_LinkMode_t mode)
+{
+	int32_t index = UARTX_LinkIndex(uart);
+	if (index < 0 || (mode != UARTX_LinkMode_IRQ && !cUARTX_LinkDMA[index].rx))
+	{
+		return false;
+	}
+
+	// A link is always set up from the state the UART driver left it in.
+	UARTX_Detach(uart);
+
+	UARTX_Link_t * link = gLinks + index;
+	link->port = port;
+	link->mask = mask;
+	link->hold = false;
+	link->errors = UARTX_Error_None;
+	link->rxDma = NULL;
+	link->txDma = NULL;
+	link->txCount = 0;
+	link->rtsHeadroom = 0;
+	link->rtsHeld = false;
+	link->uart = uart;
+	link->previous = Updater_SetHandler(cUARTX_LinkIRQn[index], cUARTX_LinkHandlers[index]);
+	USB_CDCX_OnReceive(port, UARTX_Kick);
+	USB_CDCX_OnReset(port, UARTX_Reset);
+
+	// Framing and noise errors only interrupt by themselves while DMA is receiving.
+	uart->Instance->CR1 |= USART_CR1_PEIE;
+	uart->Instance->CR3 |= USART_CR3_EIE;
+
+	// Otherwise the UART driver leaves the receive interrupt enabled.
+	if (mode & UARTX_LinkMode_RxDMA)
+	{
+		UARTX_StartReceiveDMA(link, index);
+	}
+	if (mode & UARTX_LinkMode_TxDMA)
+	{
+		UARTX_StartTransmitDMA(link, index);
+	}
+	UARTX_StartTransmit(link);
+	return true;
+}
+
+void UARTX_Detach(UART_t * uart)
+{
+	int32_t index = UARTX_LinkIndex(uart);
+	if (index < 0 || !gLinks[index].uart)
+	{
+		return;
+	}
+
+	UARTX_Link_t * link = gLinks + index;
+	USB_CDCX_OnReceive(link->port, NULL);
+	USB_CDCX_OnReset(link->port, NULL);
+	uart->Instance->CR1 &= ~(USART_CR1_TXEIE | USART_CR1_PEIE);
+	uart->Instance->CR3 &= ~USART_CR3_EIE;
+	if (link->rxDma)
+	{
+		UARTX_StopReceiveDMA(link);
+	}
+	if (link->txDma)
+	{
+		UARTX_StopTransmitDMA(link);
+	}
+	Updater_SetHandler(cUARTX_LinkIRQn[index], link->previous);
+	link->uart = NULL;
+}
+
+bool UARTX_IsAttached(UART_t * uart)
+{
+	int32_t index = UARTX_LinkIndex(uart);
+	return index >= 0 && gLinks[index].uart;
+}
+
+/*
+ * PRIVATE FUNCTIONS
+ */
+
+static bool UARTX_EncodeFraming(const UARTX_Framing_t * framing, uint32_t * cr1, uint32_t * cr2)
+{
+	*cr1 = 0;
+	*cr2 = 0;
+
+	// The USART word length includes the parity bit.
+	uint32_t bits = framing->data_bits + (framing->parity != UARTX_Parity_None ? 1 : 0);
+	switch (bits)
+	{
+	case 7:
+		*cr1 |= USART_CR1_M1;
+		break;
+	case 8:
+		break;
+	case 9:
+		*cr1 |= USART_CR1_M0;
+		break;
+	default:
+		return false;
+	}
+
+	switch (framing->parity)
+	{
+	case UARTX_Parity_None:
+		break;
+	case UARTX_Parity_Even:
+		*cr1 |= USART_CR1_PCE;
+		break;
+	case UARTX_Parity_Odd:
+		*cr1 |= USART_CR1_PCE | USART_CR1_PS;
+		break;
+	default:
+		return false;
+	}
+
+	switch (framing->stop_bits)
+	{
+	case UARTX_StopBits_1:
+		break;
+	case UARTX_StopBits_1_5:
+		*cr2 |= USART_CR2_STOP_0 | USART_CR2_STOP_1;
+		break;
+	case UARTX_StopBits_2:
+		*cr2 |= USART_CR2_STOP_1;
+		break;
+	default:
+		return false;
+	}
+	return true;
+}
+
+static bool UARTX_EncodeBaud(uint32_t clock, uint32_t baud, uint32_t * brr, uint32_t * cr1)
+{
+	if (baud == 0)
+	{
+		return false;
+	}
+
+	// 16x oversampling tolerates more noise, so it is used while the divider allows it.
+	bool over8 = (clock / baud) < 16;
+	uint32_t div;
+	uint32_t actual;
+	if (!over8)
+	{
+		div = (clock + (baud / 2)) / baud;
+		actual = div ? clock / div : 0;
+	}
+	else
+	{
+		// In 8x mode bit 0 of the divider is dropped, so only even dividers can be encoded.
+		div = 2 * ((clock + (baud / 2)) / baud);
+		actual = div ? (2 * clock) / div : 0;
+	}
+	if (div < 16 || div > 0xFFFF)
+	{
+		return false;
+	}
+
+	// The error is checked against the rate the encoded divider actually gives.
+	uint32_t error = actual > baud ? actual - baud : baud - actual;
+	if (error * 1000 > baud * UARTX_BAUD_TOLERANCE)
+	{
+		return false;
+	}
+
+	if (!over8)
+	{
+		*brr = div;
+		*cr1 = 0;
+	}
+	else
+	{
+		// The fraction is only 3 bits, and is shifted down.
+		*brr = (div & 0xFFF0) | ((div & 0x000F) >> 1);
+		*cr1 = USART_CR1_OVER8;
+	}
+	return true;
+}
+
+static int32_t UARTX_LinkIndex(UART_t * uart)
+{
+	USART_TypeDef * usart = uart->Instance;
+	if (usart == USART1) { return 0; }
+	if (usart == USART2) { return 1; }
+	if (usart == USART3) { return 2; }
+	return -1;
+}
+
+static void UARTX_Kick(uint8_t port)
+{
+	for (uint32_t i = 0; i < UARTX_LINK_COUNT; i++)
+	{
+		UARTX_Link_t * link = gLinks + i;
+		if (link->uart && link->port == port)
+		{
+			UARTX_StartTransmit(link);
+		}
+	}
+}
+
+static void UARTX_Reset(uint8_t port)
+{
+	// The port buffer is about to be emptied, so a transfer reading from it is abandoned.
+	// The span is not consumed, as it no longer exists. The next kick starts afresh.
+	for (uint32_t i = 0; i < UARTX_LINK_COUNT; i++)
+	{
+		UARTX_Link_t * link = gLinks + i;
+		if (link->uart && link->port == port && link->txDma)
+		{
+			uint32_t primask = __get_PRIMASK();
+			__disable_irq();
+			link->txDma->CCR &= ~DMA_CCR_EN;
+			DMA1->IFCR = link->txFlags;
+			link->txCount = 0;
+			__set_PRIMASK(primask);
+		}
+	}
+}
+
+static void UARTX_StartTransmit(UARTX_Link_t * link)
+{
+	// The interrupt stops itself once the port is empty.
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	if (!link->hold)
+	{
+		if (!link->txDma)
+		{
+			link->uart->Instance->CR1 |= USART_CR1_TXEIE;
+		}
+		else if (!link->txCount)
+		{
+			UARTX_NextTransmitDMA(link);
+		}
+	}
+	__set_PRIMASK(primask);
+}
+
+static void UARTX_ClaimDMA(void)
+{
+	if (gDMA.users++ == 0)
+	{
+		RCC->AHBENR |= RCC_AHBENR_DMAEN;
+		gDMA.previous = Updater_SetHandler(UARTX_DMA_IRQn, UARTX_DMA_IRQHandler);
+		NVIC_EnableIRQ(UARTX_DMA_IRQn);
+	}
+}
+
+static void UARTX_ReleaseDMA(void)
+{
+	if (--gDMA.users == 0)
+	{
+		NVIC_DisableIRQ(UARTX_DMA_IRQn);
+		Updater_SetHandler(UARTX_DMA_IRQn, gDMA.previous);
+	}
+}
+
+static void UARTX_StartReceiveDMA(UARTX_Link_t * link, int32_t index)
+{
+	const UARTX_LinkDMA_t * dma = cUARTX_LinkDMA + index;
+	UARTX_ClaimDMA();
+
+	USART_TypeDef * usart = link->uart->Instance;
+	DMA_Channel_TypeDef * channel = dma->rx;
+	channel->CCR = 0;
+	DMA1->IFCR = UARTX_DMA_FLAGS(dma->rxNumber);
+	channel->CPAR = (uint32_t)&usart->RDR;
+	channel->CMAR = (uint32_t)link->rxBfr;
+	channel->CNDTR = UARTX_RX_DMA_SIZE;
+	// Byte transfers from the peripheral, with an interrupt at each half of the buffer.
+	channel->CCR = DMA_CCR_MINC | DMA_CCR_CIRC | DMA_CCR_HTIE | DMA_CCR_TCIE | DMA_CCR_EN;
+
+	link->rxTail = 0;
+	link->rxFlags = UARTX_DMA_FLAGS(dma->rxNumber);
+	link->rxDma = channel;
+
+	// The idle line flushes bursts that do not reach the half way point.
+	usart->ICR = USART_ICR_IDLECF;
+	usart->CR3 |= USART_CR3_DMAR;
+	usart->CR1 = (usart->CR1 & ~USART_CR1_RXNEIE) | USART_CR1_IDLEIE;
+}
+
+static void UARTX_StopReceiveDMA(UARTX_Link_t * link)
+{
+	USART_TypeDef * usart = link->uart->Instance;
+	usart->CR1 &= ~USART_CR1_IDLEIE;
+	usart->CR3 &= ~USART_CR3_DMAR;
+	link->rxDma->CCR = 0;
+
+	// Anything received since the last flush is still passed on.
+	UARTX_FlushReceive(link);
+	link->rxDma = NULL;
+
+	// The UART driver expects its receive interrupt back.
+	usart->CR1 |= USART_CR1_RXNEIE;
+	UARTX_ReleaseDMA();
+}
+
+static void UARTX_FlushReceive(UARTX_Link_t * link)
+{
+	// This is run from both the USART and DMA interrupts, which may preempt each other.
+	// The port restores the mask it finds, so this stays masked throughout.
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	uint32_t head = (UARTX_RX_DMA_SIZE - link->rxDma->CNDTR) % UARTX_RX_DMA_SIZE;
+	while (link->rxTail != head)
+	{
+		// A wrapped span is written in two parts.
+		uint32_t end = head > link->rxTail ? head : UARTX_RX_DMA_SIZE;
+		uint8_t * data = link->rxBfr + link->rxTail;
+		uint32_t count = end - link->rxTail;
+		if (link->mask != 0xFF)
+		{
+			for (uint32_t i = 0; i < count; i++)
+			{
+				data[i] &= link->mask;
+			}
+		}
+		// Bytes that do not fit in the port are counted as rejected by the CDC.
+		USB_CDCX_Write(link->port, data, count);
+		link->rxTail = end % UARTX_RX_DMA_SIZE;
+	}
+	UARTX_CheckHeadroom(link);
+	__set_PRIMASK(primask);
+}
+
+static void UARTX_CheckHeadroom(UARTX_Link_t * link)
+{
+	// RTS is held as the port fills, rather than when the main loop next looks.
+	if (link->rtsHeadroom && !link->rtsHeld && USB_CDCX_WriteReady(link->port) < link->rtsHeadroom)
+	{
+		UARTX_HoldRTS(link->rts, link->rtsAf, true);
+		link->rtsHeld = true;
+	}
+}
+
+static void UARTX_StartTransmitDMA(UARTX_Link_t * link, int32_t index)
+{
+	const UARTX_LinkDMA_t * dma = cUARTX_LinkDMA + index;
+	UARTX_ClaimDMA();
+
+	USART_TypeDef * usart = link->uart->Instance;
+	DMA_Channel_TypeDef * channel = dma->tx;
+	channel->CCR = 0;
+	DMA1->IFCR = UARTX_DMA_FLAGS(dma->txNumber);
+	channel->CPAR = (uint32_t)&usart->TDR;
+	// Byte transfers to the peripheral. Each span is one transfer.
+	channel->CCR = DMA_CCR_MINC | DMA_CCR_DIR | DMA_CCR_TCIE;
+
+	link->txCount = 0;
+	link->txFlags = UARTX_DMA_FLAGS(dma->txNumber);
+	link->txDma = channel;
+	usart->CR3 |= USART_CR3_DMAT;
+}
+
+static void UARTX_StopTransmitDMA(UARTX_Link_t * link)
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	link->txDma->CCR &= ~DMA_CCR_EN;
+	DMA1->IFCR = link->txFlags;
+	// The part of the span already given to the USART is released. The rest stays in the port.
+	if (link->txCount)
+	{
+		USB_CDCX_Consume(link->port, link->txCount - link->txDma->CNDTR);
+	}
+	link->txCount = 0;
+	link->txDma = NULL;
+	__set_PRIMASK(primask);
+
+	link->uart->Instance->CR3 &= ~USART_CR3_DMAT;
+	UARTX_ReleaseDMA();
+}
+
+static void UARTX_NextTransmitDMA(UARTX_Link_t * link)
+{
+	// Interrupts must be masked. The span is read from the port in place, and is not released until it is sent.
+	const uint8_t * data;
+	uint32_t count = USB_CDCX_Peek(link->port, &data);
+	link->txCount = count;
+	if (count)
+	{
+		DMA_Channel_TypeDef * channel = link->txDma;
+		channel->CCR &= ~DMA_CCR_EN;
+		channel->CMAR = (uint32_t)data;
+		channel->CNDTR = count;
+		channel->CCR |= DMA_CCR_EN;
+	}
+}
+
+/*
+ * INTERRUPT ROUTINES
+ */
+
+static void UARTX_IRQHandler(UARTX_Link_t * link)
+{
+	USART_TypeDef * usart = link->uart->Instance;
+	uint32_t isr = usart->ISR;
+
+	if (isr & (USART_ISR_FE | USART_ISR_NE | USART_ISR_PE | USART_ISR_ORE))
+	{
+		// These raise the interrupt, and must be cleared here. RDR still holds the frame they belong to.
+		uint32_t icr = isr & (USART_ISR_FE | USART_ISR_NE | USART_ISR_PE | USART_ISR_ORE);
+		UARTX_Error_t errors = UARTX_Error_None;
+		if (isr & USART_ISR_FE)
+		{
+			// A break is a frame of zeros, stop bit included.
+			errors |= UARTX_Error_Framing;
+			if ((usart->RDR & link->mask) == 0)
+			{
+				errors |= UARTX_Error_Break;
+			}
+		}
+		if (isr & USART_ISR_PE)		{ errors |= UARTX_Error_Parity; }
+		if (isr & USART_ISR_ORE)	{ errors |= UARTX_Error_Overrun; }
+		// The ICR clear bits sit at the same positions as these flags.
+		usart->ICR = icr;
+		link->errors |= errors;
+	}
+	if (link->rxDma)
+	{
+		if (isr & USART_ISR_IDLE)
+		{
+			usart->ICR = USART_ICR_IDLECF;
+			UARTX_FlushReceive(link);
+		}
+	}
+	else if (isr & USART_ISR_RXNE)
+	{
+		// Bytes that do not fit in the port are counted as rejected by the CDC.
+		uint8_t data = usart->RDR & link->mask;
+		USB_CDCX_Write(link->port, &data, 1);
+		UARTX_CheckHeadroom(link);
+	}
+	if ((isr & USART_ISR_TXE) && (usart->CR1 & USART_CR1_TXEIE))
+	{
+		// Masked, so that a kick from the USB interrupt cannot be lost while we stop.
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		const uint8_t * data;
+		if (!link->hold && USB_CDCX_Peek(link->port, &data))
+		{
+			usart->TDR = *data;
+			USB_CDCX_Consume(link->port, 1);
+		}
+		else
+		{
+			usart->CR1 &= ~USART_CR1_TXEIE;
+		}
+		__set_PRIMASK(primask);
+	}
+}
+
+static void UARTX_USART1_IRQHandler(void)
+{
+	UARTX_IRQHandler(gLinks + 0);
+}
+
+static void UARTX_USART2_IRQHandler(void)
+{
+	UARTX_IRQHandler(gLinks + 1);
+}
+
+static void UARTX_USART3_4_IRQHandler(void)
+{
+	UARTX_IRQHandler(gLinks + 2);
+}
+
+static void UARTX_DMA_IRQHandler(void)
+{
+	uint32_t isr = DMA1->ISR;
+	for (uint32_t i = 0; i < UARTX_LINK_COUNT; i++)
+	{
+		UARTX_Link_t * link = gLinks + i;
+		if (link->rxDma && (isr & link->rxFlags))
+		{
+			DMA1->IFCR = link->rxFlags;
+			UARTX_FlushReceive(link);
+		}
+		if (link->txDma && (isr & link->txFlags))
+		{
+			DMA1->IFCR = link->txFlags;
+			uint32_t primask = __get_PRIMASK();
+			__disable_irq();
+			USB_CDCX_Consume(link->port, link->txCount);
+			link->txCount = 0;
+			if (!link->hold)
+			{
+				UARTX_NextTransmitDMA(link);
+			}
+			__set_PRIMASK(primask);
+		}
+	}
+}
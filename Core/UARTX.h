@@ -0,0 +1,116 @@
+#ifndef UARTX_H
+#define UARTX_H
+
+#include "STM32X.h"
+#include "UART.h"
+#include "GPIO.h"
+
+/*
+ * PUBLIC DEFINITIONS
+ */
+
+// The circular DMA buffer for each linked USART. Half of it is flushed to the port at a time.
+#ifndef UARTX_RX_DMA_SIZE
+#define UARTX_RX_DMA_SIZE		128
+#endif
+
+// The worst baud rate error accepted, in parts per thousand.
+// Both ends may be off by this much before sampling drifts out of the stop bit.
+#define UARTX_BAUD_TOLERANCE	20
+
+// One link for each USART interrupt: USART1, USART2 and USART3_4.
+#define UARTX_LINK_COUNT		3
+
+/*
+ * PUBLIC TYPES
+ */
+
+// These values match the CDC line coding encoding.
+typedef enum {
+	UARTX_StopBits_1	= 0,
+	UARTX_StopBits_1_5	= 1,
+	UARTX_StopBits_2	= 2,
+} UARTX_StopBits_t;
+
+typedef enum {
+	UARTX_Parity_None	= 0,
+	UARTX_Parity_Odd	= 1,
+	UARTX_Parity_Even	= 2,
+} UARTX_Parity_t;
+
+typedef enum {
+	UARTX_Error_None	= 0,
+	UARTX_Error_Framing	= (1 << 0),
+	UARTX_Error_Parity	= (1 << 1),
+	UARTX_Error_Overrun	= (1 << 2),
+	UARTX_Error_Break	= (1 << 3),
+} UARTX_Error_t;
+
+typedef enum {
+	UARTX_LinkMode_IRQ		= 0,			// Each received byte is an interrupt
+	UARTX_LinkMode_RxDMA	= (1 << 0),		// Received bytes are stored by DMA, and flushed on idle line
+	UARTX_LinkMode_TxDMA	= (1 << 1),		// Data is sent by DMA directly from the port buffer
+} UARTX_LinkMode_t;
+
+typedef struct {
+	uint8_t data_bits;
+	UARTX_Parity_t parity;
+	UARTX_StopBits_t stop_bits;
+} UARTX_Framing_t;
+
+/*
+ * PUBLIC FUNCTIONS
+ */
+
+// Initialises the UART with a non-default framing.
+// 8x oversampling is used when the baud rate is too high for 16x.
+// Returns false if the framing is not supported, or the baud cannot be generated within UARTX_BAUD_TOLERANCE.
+bool UARTX_Init(UART_t * uart, uint32_t baud, const UARTX_Framing_t * framing);
+
+// Initialises the UART for 8N1 at the given baud, and measures the rate of the next received character.
+// The character must start with bit 0 set, then bit 1 clear, such as 'A' or CR.
+bool UARTX_StartAutoBaud(UART_t * uart, uint32_t baud);
+// Returns the measured baud once a character has been seen, or zero. A failed measurement is retried.
+// The USART is left running at the measured rate.
+uint32_t UARTX_PollAutoBaud(UART_t * uart);
+
+// The mask to apply to received bytes. The parity bit is received as data for 7 bit framing.
+uint8_t UARTX_DataMask(const UARTX_Framing_t * framing);
+
+// Holds the TX pin low to send a break, and returns it to the USART when released.
+// Returns false if the USART is still sending, so that the break does not cut off earlier data.
+bool UARTX_SetBreak(UART_t * uart, GPIO_Pin_t tx, uint32_t af, bool enable);
+
+// Hands CTS and RTS to the USART. It holds transmit while CTS is high, and raises RTS while it cannot take a byte.
+// The USART is briefly disabled, so this should be changed while the line is idle. The pins are released when disabled.
+void UARTX_SetFlowControl(UART_t * uart, GPIO_Pin_t cts, GPIO_Pin_t rts, uint32_t af, bool enable);
+
+// Holds RTS high to stop the far end, and returns it to the USART when released.
+void UARTX_HoldRTS(GPIO_Pin_t rts, uint32_t af, bool hold);
+// Lets an attached link hold RTS from its receive interrupt, as soon as the port has less than headroom bytes free.
+// Zero disables this. Attaching the link also disables it. The hold is released with UARTX_HoldRTS.
+void UARTX_SetRTSHeadroom(UART_t * uart, GPIO_Pin_t rts, uint32_t af, uint32_t headroom);
+// Returns true if the receive interrupt has held RTS since the last call.
+bool UARTX_PollRTSHold(UART_t * uart);
+
+// Returns the line errors seen since the last call, and clears them.
+// Attached links latch errors in the interrupt, and report a break for a framing error on a zero frame.
+// Otherwise a break is reported when a framing error is seen while the RX pin is still low.
+UARTX_Error_t UARTX_PollErrors(UART_t * uart, GPIO_Pin_t rx);
+
+// Forwards data between the USART and a CDC port from the USART interrupt, without the main loop.
+// Received bytes are masked and written to the port. Data from the port is sent as soon as it arrives.
+// The USART interrupt is taken from the UART driver until the link is detached.
+// USART3 and USART4 share an interrupt, so USART4 cannot be used while USART3 is attached.
+// In the DMA modes the DMA channel 4-7 interrupt is also taken. These are only available on USART2 and USART3.
+bool UARTX_Attach(UART_t * uart, uint8_t port, uint8_t mask, UARTX_LinkMode_t mode);
+void UARTX_Detach(UART_t * uart);
+bool UARTX_IsAttached(UART_t * uart);
+
+/*
+ * EXTERN DECLARATIONS
+ */
+
+extern const UARTX_Framing_t cUARTX_Framing_8N1;
+
+#endif // UARTX_H
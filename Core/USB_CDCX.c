@@ -9,19 +9,9 @@
  * PRIVATE DEFINITIONS
  */
 
-#define USB_CDC_COUNT								3
-
-#ifdef USB_CDC_BFR_SIZE
-#define CDC_BFR_SIZE 	USB_CDC_BFR_SIZE
-#else
-#define CDC_BFR_SIZE 512
-#endif
-
-#define CDC_BFR_WRAP(v) ((v) & (CDC_BFR_SIZE - 1))
-
-#if (CDC_BFR_WRAP(CDC_BFR_SIZE) != 0)
-#error "USB_CDCX_BFR_SIZE must be a power of two"
-#endif
+// Buffer sizes are set per port in USB_CDC_PORTS
+#define CDC_BFR_WRAP(bfr, v) ((v) & ((bfr)->size - 1))
+#define CDC_IS_POW2(v)		(((v) & ((v) - 1)) == 0)
 
 
 // Having adjustable endpoint and interface offsets is required for composite device support
@@ -42,72 +32,167 @@
 
 #define CDC_BINTERVAL                          		0x10
 #define CDC_PACKET_SIZE								USB_PACKET_SIZE
-#define CDC_CMD_PACKET_SIZE                         8
+// By default we send packets of length 63. This gets around an issue where windows can drop full sized serial packets.
+// Ports selected in USB_CDC_FULL_PACKET_PORTS send full packets, and terminate transfers with a ZLP.
+#ifndef USB_CDC_FULL_PACKET_PORTS
+#define USB_CDC_FULL_PACKET_PORTS					0
+#endif
+#define CDC_TX_PACKET_SIZE(full)					((full) ? CDC_PACKET_SIZE : (CDC_PACKET_SIZE - 1))
+#define CDC_TX_PACKET_DEFAULT(port)					CDC_TX_PACKET_SIZE((USB_CDC_FULL_PACKET_PORTS >> (port)) & 1)
+#define CDC_CMD_PACKET_SIZE                         USB_CDCX_CMD_PACKET_SIZE
 
 #define CDC_SEND_ENCAPSULATED_COMMAND               0x00
 #define CDC_GET_ENCAPSULATED_RESPONSE               0x01
-#define CDC_SET_COMM_FEATURE                        0x02
-#define CDC_GET_COMM_FEATURE                        0x03
-#define CDC_CLEAR_COMM_FEATURE                      0x04
 #define CDC_SET_LINE_CODING                         0x20
 #define CDC_GET_LINE_CODING                         0x21
 #define CDC_SET_CONTROL_LINE_STATE                  0x22
 #define CDC_SEND_BREAK                              0x23
 
+#define CDC_REQ_DIR_MASK							0x80
+#define CDC_REQ_DIR_OUT								0x00
+#define CDC_REQ_DIR_IN								0x80
+
+#define CDC_NOTIFY_REQUEST_TYPE						0xA1
+#define CDC_NOTIFY_SERIAL_STATE						0x20
+#define CDC_NOTIFY_SIZE								10
+
+#define CDC_FRAME_MASK								USB_FNR_FN
+#define CDC_FRAME()									(USB->FNR & CDC_FRAME_MASK)
+
+#define CDC_STATE_EVENTS							(USB_CDCX_State_Break | USB_CDCX_State_Ring | USB_CDCX_State_Framing \
+													| USB_CDCX_State_Parity | USB_CDCX_State_Overrun)
+
 
 /*
  * PRIVATE TYPES
  */
 
 typedef struct {
-	uint8_t buffer[CDC_BFR_SIZE];
+	uint8_t * buffer;
+	uint32_t size;
 	uint32_t head;
 	uint32_t tail;
 } CDCBuffer_t;
 
+typedef enum {
+	CDC_CtlState_Idle,
+	CDC_CtlState_DataOut,
+} CDC_CtlState_t;
+
+typedef struct {
+	uint8_t request;
+	uint8_t direction;	// Direction of the data stage
+	uint8_t size;		// Length of the data stage
+	void (*handler)(uint8_t port, uint16_t value, uint8_t * data);
+} CDC_Request_t;
+
+// Each port stages its own control data, so requests to different ports cannot collide.
+typedef struct {
+	CDC_CtlState_t state;
+	const CDC_Request_t * request;
+	uint16_t value;
+	// Not sure why this needs to be aligned?
+	uint32_t data[CDC_CMD_PACKET_SIZE/4];
+} CDC_Ctl_t;
+
 typedef struct {
 	volatile bool txBusy;
+	uint8_t txLatency;
+	uint8_t txPacket;
+	uint16_t txFrame;
+	volatile bool rxHeld;
+	uint32_t rxHeldTick;
+	volatile bool rxDirect;
 	volatile bool dtr;
+	volatile bool lineCodingChanged;
+	volatile bool controlChanged;
+	uint16_t controlLines;
+	volatile bool breakChanged;
+	uint16_t breakDuration;
+	CDC_Ctl_t ctl;
+	volatile bool notifyBusy;
+	volatile bool notifyPending;
+	uint16_t serialState;
+	uint8_t notify[CDC_NOTIFY_SIZE];
 	uint8_t lineCoding[7];
+	USB_CDCX_Callback_t onReceive;
+	USB_CDCX_Callback_t onReset;
 	CDCBuffer_t rx;
+	CDCBuffer_t tx;
+	// Only used when a packet would wrap around the end of the rx buffer.
 	uint8_t rx_packet[CDC_PACKET_SIZE];
+	USB_CDCX_Stats_t stats;
 } CDC_t;
 
 typedef struct {
-	uint8_t opcode;
-	uint8_t size;
-	uint8_t port;
-	// Not sure why this needs to be aligned?
-	uint32_t data[CDC_CMD_PACKET_SIZE/4];
-} CDC_CMD_t;
+	void (*receive)(uint32_t count);
+	void (*transmitDone)(uint32_t count);
+	void (*notifyDone)(uint32_t count);
+	void (*ctlRxReady)(void);
+} CDC_Callbacks_t;
 
 /*
  * PRIVATE PROTOTYPES
  */
 
-static void USB_CDC_Control(uint8_t port, uint8_t cmd, uint8_t* data, uint16_t length);
-static void USB_CDC_CtlRxReady(void);
+static const CDC_Request_t * USB_CDC_FindRequest(uint8_t request);
+static void USB_CDC_CtlRxReady(uint8_t port);
+static void USB_CDC_TransmitNext(uint8_t port);
+static void USB_CDC_ReceiveNext(uint8_t port);
+static void USB_CDC_EnableSOF(bool enable);
+static void USB_CDC_NotifyNext(uint8_t port);
 
-#if (USB_CDC_COUNT > 0)
-static void USB_CDC_Receive0(uint32_t count);
-static void USB_CDC_TransmitDone0(uint32_t count);
-#endif
-#if (USB_CDC_COUNT > 1)
-static void USB_CDC_Receive1(uint32_t count);
-static void USB_CDC_TransmitDone1(uint32_t count);
-#endif
-#if (USB_CDC_COUNT > 2)
-static void USB_CDC_Receive2(uint32_t count);
-static void USB_CDC_TransmitDone2(uint32_t count);
-#endif
+static void USB_CDC_Receive(uint8_t port, uint32_t count);
+static void USB_CDC_TransmitDone(uint8_t port, uint32_t count);
+static void USB_CDC_NotifyDone(uint8_t port, uint32_t count);
+
+// Class request handlers
+static void CDC_SetLineCoding(uint8_t port, uint16_t value, uint8_t * data);
+static void CDC_GetLineCoding(uint8_t port, uint16_t value, uint8_t * data);
+static void CDC_SetControlLineState(uint8_t port, uint16_t value, uint8_t * data);
+static void CDC_SendBreak(uint8_t port, uint16_t value, uint8_t * data);
+
+// Endpoint and control callbacks for each port in the table
+#define CDC_PORT_PROTOTYPES(n, rx, tx)	\
+	static void USB_CDC_Receive##n(uint32_t count); \
+	static void USB_CDC_TransmitDone##n(uint32_t count); \
+	static void USB_CDC_NotifyDone##n(uint32_t count); \
+	static void USB_CDC_CtlRxReady##n(void);
+USB_CDC_PORTS(CDC_PORT_PROTOTYPES)
 
 
 /*
  * PRIVATE VARIABLES
  */
 
-static CDC_t gCDC[USB_CDC_COUNT];
-static CDC_CMD_t gCMD;
+#define CDC_PORT_CALLBACKS(n, rx, tx)		[n] = { USB_CDC_Receive##n, USB_CDC_TransmitDone##n, USB_CDC_NotifyDone##n, USB_CDC_CtlRxReady##n },
+static const CDC_Callbacks_t cCDC_Callbacks[] = {
+	USB_CDC_PORTS(CDC_PORT_CALLBACKS)
+};
+
+_Static_assert(LENGTH(cCDC_Callbacks) == USB_CDC_COUNT, "USB_CDC_PORTS must be numbered from 0");
+
+static const CDC_Request_t cCDC_Requests[] = {
+	{ CDC_SET_LINE_CODING,			CDC_REQ_DIR_OUT,	7,	CDC_SetLineCoding },
+	{ CDC_GET_LINE_CODING,			CDC_REQ_DIR_IN,		7,	CDC_GetLineCoding },
+	{ CDC_SET_CONTROL_LINE_STATE,	CDC_REQ_DIR_OUT,	0,	CDC_SetControlLineState },
+	{ CDC_SEND_BREAK,				CDC_REQ_DIR_OUT,	0,	CDC_SendBreak },
+};
+
+#define CDC_PORT_BUFFERS(n, rx_size, tx_size)	\
+	_Static_assert(CDC_IS_POW2(rx_size) && CDC_IS_POW2(tx_size), "CDC buffer sizes must be a power of two"); \
+	_Static_assert((rx_size) > CDC_PACKET_SIZE, "CDC rx buffer must be larger than a packet"); \
+	static uint8_t gCDC_RxBuffer##n[rx_size]; \
+	static uint8_t gCDC_TxBuffer##n[tx_size];
+USB_CDC_PORTS(CDC_PORT_BUFFERS)
+
+#define CDC_PORT_INIT(n, rx_size, tx_size)	\
+	[n] = { .rx = { .buffer = gCDC_RxBuffer##n, .size = rx_size }, .tx = { .buffer = gCDC_TxBuffer##n, .size = tx_size }, \
+			.txPacket = CDC_TX_PACKET_DEFAULT(n) },
+static CDC_t gCDC[USB_CDC_COUNT] = {
+	USB_CDC_PORTS(CDC_PORT_INIT)
+};
+static volatile bool gCDCOpen;
 
 /*
  * PUBLIC FUNCTIONS
@@ -121,91 +206,142 @@ void USB_CDCX_Init(uint8_t config)
 	for (uint8_t port = 0; port < USB_CDC_COUNT; port++)
 	{
 		CDC_t * cdc = gCDC + port;
+		if (cdc->onReset)
+		{
+			cdc->onReset(port);
+		}
 		cdc->rx.head = cdc->rx.tail = 0;
+		cdc->tx.head = cdc->tx.tail = 0;
 		cdc->txBusy = false;
+		cdc->txFrame = 0;
+		cdc->rxHeld = false;
+		cdc->rxDirect = false;
 		cdc->dtr = false;
+		cdc->lineCodingChanged = false;
+		cdc->controlChanged = false;
+		cdc->controlLines = 0;
+		cdc->breakChanged = false;
+		cdc->breakDuration = 0;
+		cdc->ctl.state = CDC_CtlState_Idle;
+		cdc->notifyBusy = false;
+		cdc->notifyPending = false;
+		// Stats are deliberately kept across re-enumeration.
 		memcpy(cdc->lineCoding, lineCoding, sizeof(cdc->lineCoding));
-	}
 
-#if (USB_CDC_COUNT > 0)
-	// Data endpoints 0
-	USB_EP_Open(CDC_IN_EP(0), USB_EP_TYPE_BULK, CDC_PACKET_SIZE, USB_CDC_TransmitDone0);
-	USB_EP_Open(CDC_OUT_EP(0), USB_EP_TYPE_BULK, CDC_PACKET_SIZE, USB_CDC_Receive0);
-	USB_EP_Open(CDC_CMD_EP(0), USB_EP_TYPE_BULK, CDC_CMD_PACKET_SIZE, USB_CDC_TransmitDone0);
-	USB_EP_Read(CDC_OUT_EP(0), gCDC[0].rx_packet, CDC_PACKET_SIZE);
-#endif
-#if (USB_CDC_COUNT > 1)
-	// Data endpoints 1
-	USB_EP_Open(CDC_IN_EP(1), USB_EP_TYPE_BULK, CDC_PACKET_SIZE, USB_CDC_TransmitDone1);
-	USB_EP_Open(CDC_OUT_EP(1), USB_EP_TYPE_BULK, CDC_PACKET_SIZE, USB_CDC_Receive1);
-	USB_EP_Open(CDC_CMD_EP(1), USB_EP_TYPE_BULK, CDC_CMD_PACKET_SIZE, USB_CDC_TransmitDone1);
-	USB_EP_Read(CDC_OUT_EP(1), gCDC[1].rx_packet, CDC_PACKET_SIZE);
-#endif
-#if (USB_CDC_COUNT > 2)
-	// Data endpoints 2
-	USB_EP_Open(CDC_IN_EP(2), USB_EP_TYPE_BULK, CDC_PACKET_SIZE, USB_CDC_TransmitDone2);
-	USB_EP_Open(CDC_OUT_EP(2), USB_EP_TYPE_BULK, CDC_PACKET_SIZE, USB_CDC_Receive2);
-	USB_EP_Open(CDC_CMD_EP(2), USB_EP_TYPE_BULK, CDC_CMD_PACKET_SIZE, USB_CDC_TransmitDone2);
-	USB_EP_Read(CDC_OUT_EP(2), gCDC[2].rx_packet, CDC_PACKET_SIZE);
-#endif
+		// Data endpoints
+		const CDC_Callbacks_t * callbacks = cCDC_Callbacks + port;
+		USB_EP_Open(CDC_IN_EP(port), USB_EP_TYPE_BULK, CDC_PACKET_SIZE, callbacks->transmitDone);
+		USB_EP_Open(CDC_OUT_EP(port), USB_EP_TYPE_BULK, CDC_PACKET_SIZE, callbacks->receive);
+		USB_EP_Open(CDC_CMD_EP(port), USB_EP_TYPE_INTR, CDC_CMD_PACKET_SIZE, callbacks->notifyDone);
+		USB_CDC_ReceiveNext(port);
+	}
+	gCDCOpen = true;
 }
 
 void USB_CDCX_Deinit(void)
 {
+	gCDCOpen = false;
 	for (uint8_t port = 0; port < USB_CDC_COUNT; port++)
 	{
 		CDC_t * cdc = gCDC + port;
 		USB_EP_Close(CDC_IN_EP(port));
 		USB_EP_Close(CDC_OUT_EP(port));
 		USB_EP_Close(CDC_CMD_EP(port));
+		if (cdc->onReset)
+		{
+			cdc->onReset(port);
+		}
 		cdc->rx.head = cdc->rx.tail = 0;
+		cdc->tx.head = cdc->tx.tail = 0;
 		cdc->dtr = false;
 	}
+	USB_CDC_EnableSOF(false);
 }
 
-void USB_CDCX_Write(uint8_t port, const uint8_t * data, uint32_t count)
+uint32_t USB_CDCX_Write(uint8_t port, const uint8_t * data, uint32_t count)
 {
-	// This will block if the transmitter is not free, or multiple packets are sent out.
-	uint32_t tide = CORE_GetTick();
+	// This will not block. Any data that does not fit in the tx buffer is rejected.
 	CDC_t * cdc = gCDC + port;
-	while (count)
+	uint32_t space = USB_CDCX_WriteReady(port);
+
+	if (count > space)
+	{
+		cdc->stats.tx_rejected += count - space;
+		count = space;
+	}
+	if (count > 0)
 	{
-		if (!cdc->dtr)
+		// Only the writer moves the head, so the free space can be filled before the interrupt is masked.
+		uint32_t head = cdc->tx.head;
+		uint32_t newhead = CDC_BFR_WRAP(&cdc->tx, head + count);
+		if (newhead > head)
 		{
-			return;
+			// We can write continuously into the buffer
+			memcpy(cdc->tx.buffer + head, data, count);
 		}
-		if (cdc->txBusy)
+		else
 		{
-			// Wait for transmit to be free. Abort if it does not come free.
-			if (CORE_GetTick() - tide > 10 || !cdc->dtr)
-			{
-				break;
-			}
-			CORE_Idle();
+			// We write to end of buffer, then write from the start
+			uint32_t chunk = cdc->tx.size - head;
+			memcpy(cdc->tx.buffer + head, data, chunk);
+			memcpy(cdc->tx.buffer, data + chunk, count - chunk);
 		}
-		else
+
+		// The USB interrupt moves the tail and reads the frame, so the data is published with it masked.
+		// The caller may already have interrupts masked, so the mask is restored rather than cleared.
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		if (head == cdc->tx.tail)
+		{
+			// Coalescing latency is measured from the oldest data in the buffer.
+			cdc->txFrame = CDC_FRAME();
+		}
+		cdc->tx.head = newhead;
+
+		uint32_t pending = CDC_BFR_WRAP(&cdc->tx, newhead - cdc->tx.tail);
+		if (pending > cdc->stats.tx_peak)
+		{
+			cdc->stats.tx_peak = pending;
+		}
+
+		// If the endpoint is idle we need to start the transfer.
+		// Otherwise the transmit complete callback will pick up the new data.
+		if (!cdc->txBusy)
 		{
-			// Transmit a packet
-			// We send packets of length 63. This gets around an issue where windows can drop full sized serial packets.
-			uint32_t packet_size = count > (CDC_PACKET_SIZE - 1) ? (CDC_PACKET_SIZE - 1) : count;
-			cdc->txBusy = true;
-			USB_EP_Write(CDC_IN_EP(port), data, packet_size);
-			count -= packet_size;
-			data += packet_size;
+			USB_CDC_TransmitNext(port);
 		}
+		__set_PRIMASK(primask);
 	}
+	return count;
+}
+
+uint32_t USB_CDCX_WriteStr(uint8_t port, const char * str)
+{
+	return USB_CDCX_Write(port, (const uint8_t *)str, strlen(str));
 }
 
-void USB_CDCX_WriteStr(uint8_t port, const char * str)
+bool USB_CDCX_IsOpen(uint8_t port)
 {
-	USB_CDCX_Write(port, (const uint8_t *)str, strlen(str));
+	return gCDC[port].dtr;
+}
+
+uint32_t USB_CDCX_WriteReady(uint8_t port)
+{
+	CDC_t * cdc = gCDC + port;
+	if (!cdc->dtr)
+	{
+		// Nobody is listening.
+		return 0;
+	}
+	// Minus 1 because head == tail represents the empty condition.
+	return CDC_BFR_WRAP(&cdc->tx, cdc->tx.tail - cdc->tx.head - 1);
 }
 
 uint32_t USB_CDCX_ReadReady(uint8_t port)
 {
 	CDC_t * cdc = gCDC + port;
 	// Assume these reads are atomic
-	return CDC_BFR_WRAP(cdc->rx.head - cdc->rx.tail);
+	return CDC_BFR_WRAP(&cdc->rx, cdc->rx.head - cdc->rx.tail);
 }
 
 uint32_t USB_CDCX_Read(uint8_t port, uint8_t * data, uint32_t count)
@@ -220,8 +356,7 @@ uint32_t USB_CDCX_Read(uint8_t port, uint8_t * data, uint32_t count)
 	if (count > 0)
 	{
 		uint32_t tail = cdc->rx.tail;
-		uint32_t newtail = CDC_BFR_WRAP( tail + count );
-		if (newtail > tail)
+		if (tail + count <= cdc->rx.size)
 		{
 			// We can read continuously from the buffer
 			memcpy(data, cdc->rx.buffer + tail, count);
@@ -229,93 +364,347 @@ uint32_t USB_CDCX_Read(uint8_t port, uint8_t * data, uint32_t count)
 		else
 		{
 			// We read to end of buffer, then read from the start
-			uint32_t chunk = CDC_BFR_SIZE - tail;
+			uint32_t chunk = cdc->rx.size - tail;
 			memcpy(data, cdc->rx.buffer + tail, chunk);
 			memcpy(data + chunk, cdc->rx.buffer, count - chunk);
 		}
-		cdc->rx.tail = newtail;
+		USB_CDCX_Consume(port, count);
 	}
 	return count;
 }
 
-void USB_CDCX_Setup(uint8_t port, USB_SetupRequest_t * req)
+uint32_t USB_CDCX_Peek(uint8_t port, const uint8_t ** data)
 {
-	if (req->wLength)
+	CDC_t * cdc = gCDC + port;
+	uint32_t tail = cdc->rx.tail;
+	uint32_t ready = USB_CDCX_ReadReady(port);
+
+	// Only the continuous section is exposed. The rest is available after a consume.
+	uint32_t chunk = cdc->rx.size - tail;
+	*data = cdc->rx.buffer + tail;
+	return ready < chunk ? ready : chunk;
+}
+
+void USB_CDCX_Consume(uint8_t port, uint32_t count)
+{
+	CDC_t * cdc = gCDC + port;
+
+	// A reset of the port may have dropped the span since it was peeked.
+	uint32_t ready = USB_CDCX_ReadReady(port);
+	if (count > ready)
+	{
+		count = ready;
+	}
+	cdc->rx.tail = CDC_BFR_WRAP(&cdc->rx, cdc->rx.tail + count);
+
+	// The OUT endpoint is not re-armed while the buffer is full.
+	// The endpoint is idle while held, so this cannot race the receive callback.
+	if (cdc->rxHeld)
+	{
+		USB_CDC_ReceiveNext(port);
+	}
+}
+
+void USB_CDCX_OnReceive(uint8_t port, USB_CDCX_Callback_t callback)
+{
+	gCDC[port].onReceive = callback;
+}
+
+void USB_CDCX_OnReset(uint8_t port, USB_CDCX_Callback_t callback)
+{
+	gCDC[port].onReset = callback;
+}
+
+void USB_CDCX_SetLatency(uint8_t port, uint8_t frames)
+{
+	gCDC[port].txLatency = frames;
+}
+
+void USB_CDCX_SetFullPackets(uint8_t port, bool enable)
+{
+	gCDC[port].txPacket = CDC_TX_PACKET_SIZE(enable);
+}
+
+bool USB_CDCX_GetFullPackets(uint8_t port)
+{
+	return gCDC[port].txPacket == CDC_PACKET_SIZE;
+}
+
+void USB_CDCX_SOF(void)
+{
+	// Release any coalesced data that has reached its latency budget.
+	bool held = false;
+	for (uint8_t port = 0; port < USB_CDC_COUNT; port++)
 	{
-		if (req->bmRequest & 0x80U)
+		CDC_t * cdc = gCDC + port;
+		if (!cdc->txBusy && cdc->tx.head != cdc->tx.tail)
 		{
-			USB_CDC_Control(port, req->bRequest, (uint8_t *)gCMD.data, req->wLength);
-			USB_CTL_Send((uint8_t *)gCMD.data, req->wLength);
+			USB_CDC_TransmitNext(port);
+			held |= !cdc->txBusy;
 		}
-		else
+	}
+	// The SOF interrupt is only taken while data is held back.
+	if (!held)
+	{
+		USB_CDC_EnableSOF(false);
+	}
+}
+
+void USB_CDCX_GetStats(uint8_t port, USB_CDCX_Stats_t * stats)
+{
+	// The counters are updated from the USB interrupt.
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	*stats = gCDC[port].stats;
+	__set_PRIMASK(primask);
+}
+
+void USB_CDCX_ResetStats(uint8_t port)
+{
+	CDC_t * cdc = gCDC + port;
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	bzero(&cdc->stats, sizeof(cdc->stats));
+	cdc->rxHeldTick = CORE_GetTick();
+	__set_PRIMASK(primask);
+}
+
+bool USB_CDCX_PollLineCoding(uint8_t port, USB_CDCX_LineCoding_t * coding)
+{
+	CDC_t * cdc = gCDC + port;
+	if (!cdc->lineCodingChanged)
+	{
+		return false;
+	}
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	cdc->lineCodingChanged = false;
+	const uint8_t * lc = cdc->lineCoding;
+	coding->baud = lc[0] | (lc[1] << 8) | (lc[2] << 16) | ((uint32_t)lc[3] << 24);
+	coding->stop_bits = lc[4];
+	coding->parity = lc[5];
+	coding->data_bits = lc[6];
+	__set_PRIMASK(primask);
+	return true;
+}
+
+bool USB_CDCX_PollControlLines(uint8_t port, USB_CDCX_Control_t * lines)
+{
+	CDC_t * cdc = gCDC + port;
+	if (!cdc->controlChanged)
+	{
+		return false;
+	}
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	cdc->controlChanged = false;
+	*lines = cdc->controlLines;
+	__set_PRIMASK(primask);
+	return true;
+}
+
+void USB_CDCX_SetSerialState(uint8_t port, USB_CDCX_State_t state)
+{
+	CDC_t * cdc = gCDC + port;
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	// Events that have not been sent yet are kept.
+	state = (state & ~CDC_STATE_EVENTS) | (cdc->serialState & CDC_STATE_EVENTS);
+	if (state != cdc->serialState)
+	{
+		cdc->serialState = state;
+		cdc->notifyPending = true;
+		if (gCDCOpen && !cdc->notifyBusy)
+		{
+			USB_CDC_NotifyNext(port);
+		}
+	}
+	__set_PRIMASK(primask);
+}
+
+void USB_CDCX_SignalEvents(uint8_t port, USB_CDCX_State_t events)
+{
+	CDC_t * cdc = gCDC + port;
+	events &= CDC_STATE_EVENTS;
+	if (events)
+	{
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		cdc->serialState |= events;
+		cdc->notifyPending = true;
+		if (gCDCOpen && !cdc->notifyBusy)
 		{
-			gCMD.port = port;
-			gCMD.opcode = req->bRequest;
-			gCMD.size = req->wLength;
-			USB_CTL_Receive((uint8_t *)gCMD.data, req->wLength, USB_CDC_CtlRxReady);
+			USB_CDC_NotifyNext(port);
 		}
+		__set_PRIMASK(primask);
+	}
+}
+
+void USB_CDCX_Setup(uint8_t port, USB_SetupRequest_t * req)
+{
+	CDC_Ctl_t * ctl = &gCDC[port].ctl;
+
+	// A new setup abandons any data stage still in progress.
+	ctl->state = CDC_CtlState_Idle;
+
+	const CDC_Request_t * request = USB_CDC_FindRequest(req->bRequest);
+	if (request == NULL || (req->bmRequest & CDC_REQ_DIR_MASK) != request->direction)
+	{
+		// Unsupported requests are stalled, so the host is not left waiting.
+		// So is a request in the wrong direction, rather than running its handler on no data.
+		USB_CTL_Stall();
+		return;
+	}
+
+	uint8_t * data = (uint8_t *)ctl->data;
+	if (request->direction == CDC_REQ_DIR_IN)
+	{
+		bzero(ctl->data, sizeof(ctl->data));
+		request->handler(port, req->wValue, data);
+		USB_CTL_Send(data, req->wLength < request->size ? req->wLength : request->size);
+	}
+	else if (req->wLength != request->size)
+	{
+		// The data stage must match the request.
+		USB_CTL_Stall();
+		return;
+	}
+	else if (request->size)
+	{
+		ctl->request = request;
+		ctl->value = req->wValue;
+		ctl->state = CDC_CtlState_DataOut;
+		USB_CTL_Receive(data, request->size, cCDC_Callbacks[port].ctlRxReady);
 	}
 	else
 	{
-		USB_CDC_Control(port, req->bRequest, (uint8_t *)req, 0U);
+		request->handler(port, req->wValue, NULL);
+	}
+}
+
+bool USB_CDCX_PollBreak(uint8_t port, uint16_t * duration)
+{
+	CDC_t * cdc = gCDC + port;
+	if (!cdc->breakChanged)
+	{
+		return false;
 	}
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	cdc->breakChanged = false;
+	*duration = cdc->breakDuration;
+	__set_PRIMASK(primask);
+	return true;
 }
 
 /*
- * PRIVATE FUNCTIONS
+ * PRIVATE FUNCTIONS: CONTROL
  */
 
-static void USB_CDC_CtlRxReady(void)
+static const CDC_Request_t * USB_CDC_FindRequest(uint8_t request)
+{
+	for (uint32_t i = 0; i < LENGTH(cCDC_Requests); i++)
+	{
+		if (cCDC_Requests[i].request == request)
+		{
+			return cCDC_Requests + i;
+		}
+	}
+	return NULL;
+}
+
+static void USB_CDC_CtlRxReady(uint8_t port)
 {
-	if (gCMD.opcode != 0xFF)
+	CDC_Ctl_t * ctl = &gCDC[port].ctl;
+	if (ctl->state == CDC_CtlState_DataOut)
 	{
-		USB_CDC_Control(gCMD.port, gCMD.opcode, (uint8_t *)gCMD.data,  gCMD.size);
-		gCMD.opcode = 0xFF;
+		ctl->state = CDC_CtlState_Idle;
+		ctl->request->handler(port, ctl->value, (uint8_t *)ctl->data);
 	}
 }
 
-static void USB_CDC_Control(uint8_t port, uint8_t cmd, uint8_t* data, uint16_t length)
+static void CDC_SetLineCoding(uint8_t port, uint16_t value, uint8_t * data)
+{
+	CDC_t * cdc = gCDC + port;
+	memcpy(cdc->lineCoding, data, sizeof(cdc->lineCoding));
+	cdc->lineCodingChanged = true;
+}
+
+static void CDC_GetLineCoding(uint8_t port, uint16_t value, uint8_t * data)
+{
+	CDC_t * cdc = gCDC + port;
+	memcpy(data, cdc->lineCoding, sizeof(cdc->lineCoding));
+}
+
+static void CDC_SetControlLineState(uint8_t port, uint16_t value, uint8_t * data)
 {
 	CDC_t * cdc = gCDC + port;
-	switch(cmd)
-	{
-	case CDC_SET_LINE_CODING:
-		memcpy(cdc->lineCoding, data, sizeof(cdc->lineCoding));
-		break;
-	case CDC_GET_LINE_CODING:
-		memcpy(data, cdc->lineCoding, sizeof(cdc->lineCoding));
-		break;
-	case CDC_SET_CONTROL_LINE_STATE:
-		cdc->dtr = ((USB_SetupRequest_t*)data)->wValue & 0x0001;
-		break;
-	case CDC_SEND_ENCAPSULATED_COMMAND:
-	case CDC_GET_ENCAPSULATED_RESPONSE:
-	case CDC_SET_COMM_FEATURE:
-	case CDC_GET_COMM_FEATURE:
-	case CDC_CLEAR_COMM_FEATURE:
-	case CDC_SEND_BREAK:
-	default:
-		break;
+	cdc->controlLines = value & (USB_CDCX_Control_DTR | USB_CDCX_Control_RTS);
+	cdc->controlChanged = true;
+	cdc->dtr = cdc->controlLines & USB_CDCX_Control_DTR;
+	if (cdc->dtr)
+	{
+		// Let the newly opened port know the current line state.
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		cdc->notifyPending = true;
+		if (!cdc->notifyBusy)
+		{
+			USB_CDC_NotifyNext(port);
+		}
+		__set_PRIMASK(primask);
 	}
 }
 
+static void CDC_SendBreak(uint8_t port, uint16_t value, uint8_t * data)
+{
+	CDC_t * cdc = gCDC + port;
+	cdc->breakDuration = value;
+	cdc->breakChanged = true;
+}
+
+/*
+ * PRIVATE FUNCTIONS: DATA
+ */
+
 static void USB_CDC_Receive(uint8_t port, uint32_t count)
 {
 	CDC_t * cdc = gCDC + port;
-	if (cdc->dtr)
+	cdc->stats.rx_packets++;
+	cdc->stats.rx_bytes += count;
+
+	if (!cdc->dtr)
 	{
+		// Nobody is listening.
+		cdc->stats.rx_dropped += count;
+	}
+	else if (cdc->rxDirect)
+	{
+		// The packet was read straight into the buffer. We just need to accept it.
+		cdc->stats.rx_direct++;
+		cdc->rx.head = CDC_BFR_WRAP(&cdc->rx, cdc->rx.head + count);
+	}
+	else
+	{
+		cdc->stats.rx_bounced++;
+
 		// Minus 1 because head == tail represents the empty condition.
-		uint32_t space = CDC_BFR_WRAP(cdc->rx.tail - cdc->rx.head - 1);
+		uint32_t space = CDC_BFR_WRAP(&cdc->rx, cdc->rx.tail - cdc->rx.head - 1);
 
 		if (count > space)
 		{
+			// This should not happen, as the endpoint is not armed unless a full packet will fit.
 			// Discard any data that we cannot insert into the buffer.
+			cdc->stats.rx_dropped += count - space;
 			count = space;
 		}
 		if (count > 0)
 		{
 			uint32_t head = cdc->rx.head;
-			uint32_t newhead = CDC_BFR_WRAP( head + count );
+			uint32_t newhead = CDC_BFR_WRAP(&cdc->rx, head + count);
 			if (newhead > head)
 			{
 				// We can write continuously into the buffer
@@ -324,7 +713,7 @@ static void USB_CDC_Receive(uint8_t port, uint32_t count)
 			else
 			{
 				// We write to end of buffer, then write from the start
-				uint32_t chunk = CDC_BFR_SIZE - head;
+				uint32_t chunk = cdc->rx.size - head;
 				memcpy(cdc->rx.buffer + head, cdc->rx_packet, chunk);
 				memcpy(cdc->rx.buffer, cdc->rx_packet + chunk, count - chunk);
 			}
@@ -332,33 +721,173 @@ static void USB_CDC_Receive(uint8_t port, uint32_t count)
 		}
 	}
 
-	USB_EP_Read(CDC_OUT_EP(port), cdc->rx_packet, CDC_PACKET_SIZE);
+	uint32_t ready = CDC_BFR_WRAP(&cdc->rx, cdc->rx.head - cdc->rx.tail);
+	if (ready > cdc->stats.rx_peak)
+	{
+		cdc->stats.rx_peak = ready;
+	}
+
+	USB_CDC_ReceiveNext(port);
+	if (cdc->onReceive && ready)
+	{
+		cdc->onReceive(port);
+	}
+}
+
+static void USB_CDC_ReceiveNext(uint8_t port)
+{
+	CDC_t * cdc = gCDC + port;
+	uint32_t space = CDC_BFR_WRAP(&cdc->rx, cdc->rx.tail - cdc->rx.head - 1);
+
+	if (space < CDC_PACKET_SIZE)
+	{
+		// Leave the endpoint un-armed, so the host gets NAKs until we catch up.
+		// USB_CDCX_Read will re-arm it once there is space.
+		if (!cdc->rxHeld)
+		{
+			cdc->rxHeld = true;
+			cdc->rxHeldTick = CORE_GetTick();
+		}
+	}
+	else
+	{
+		if (cdc->rxHeld)
+		{
+			cdc->rxHeld = false;
+			cdc->stats.rx_held_ms += CORE_GetTick() - cdc->rxHeldTick;
+		}
+		uint32_t head = cdc->rx.head;
+		// If a whole packet fits before the wrap, then read it directly into the buffer.
+		// Otherwise we need to bounce it through the packet buffer.
+		cdc->rxDirect = (cdc->rx.size - head) >= CDC_PACKET_SIZE;
+		uint8_t * dst = cdc->rxDirect ? cdc->rx.buffer + head : cdc->rx_packet;
+		USB_EP_Read(CDC_OUT_EP(port), dst, CDC_PACKET_SIZE);
+	}
+}
+
+static void USB_CDC_TransmitNext(uint8_t port)
+{
+	CDC_t * cdc = gCDC + port;
+	uint32_t tail = cdc->tx.tail;
+	uint32_t count = CDC_BFR_WRAP(&cdc->tx, cdc->tx.head - tail);
+
+	if (count == 0)
+	{
+		cdc->txBusy = false;
+		return;
+	}
+
+	if (cdc->txLatency && count < cdc->txPacket
+			&& ((CDC_FRAME() - cdc->txFrame) & CDC_FRAME_MASK) < cdc->txLatency)
+	{
+		// Hold short packets until they fill, or the latency budget runs out.
+		// USB_CDCX_SOF will release them.
+		cdc->txBusy = false;
+		USB_CDC_EnableSOF(true);
+		return;
+	}
+
+	// Only the continuous section is sent. Any wrapped data goes out in the next packet.
+	uint32_t chunk = cdc->tx.size - tail;
+	if (count > chunk)
+	{
+		count = chunk;
+	}
+	if (count > cdc->txPacket)
+	{
+		count = cdc->txPacket;
+	}
+
+	cdc->txBusy = true;
+	if (count == CDC_BFR_WRAP(&cdc->tx, cdc->tx.head - tail))
+	{
+		// Everything pending is going out, so any later data is newer than this frame.
+		// Data left behind by a wrap or a full packet keeps the older timestamp.
+		cdc->txFrame = CDC_FRAME();
+	}
+	USB_EP_Write(CDC_IN_EP(port), cdc->tx.buffer + tail, count);
+}
+
+static void USB_CDC_EnableSOF(bool enable)
+{
+	// CNTR is shared with the suspend and resume handling, so this must not be interrupted.
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	if (enable)
+	{
+		USB->CNTR |= USB_CNTR_SOFM;
+	}
+	else
+	{
+		USB->CNTR &= ~USB_CNTR_SOFM;
+	}
+	__set_PRIMASK(primask);
 }
 
 static void USB_CDC_TransmitDone(uint8_t port, uint32_t count)
 {
 	CDC_t * cdc = gCDC + port;
-	if (count > 0 && (count % CDC_PACKET_SIZE) == 0)
+
+	// The transmitted data can now be released from the buffer.
+	cdc->tx.tail = CDC_BFR_WRAP(&cdc->tx, cdc->tx.tail + count);
+	if (count > 0)
+	{
+		cdc->stats.tx_packets++;
+		cdc->stats.tx_bytes += count;
+	}
+
+	if (count > 0 && (count % CDC_PACKET_SIZE) == 0 && cdc->tx.tail == cdc->tx.head)
 	{
 		// Write a ZLP to complete the tx.
+		cdc->stats.tx_zlps++;
 		USB_EP_WriteZLP(CDC_IN_EP(port));
 	}
 	else
 	{
-		cdc->txBusy = false;
+		USB_CDC_TransmitNext(port);
 	}
 }
 
-#if (USB_CDC_COUNT > 0)
-static void USB_CDC_Receive0(uint32_t count) 		{ USB_CDC_Receive(0, count); }
-static void USB_CDC_TransmitDone0(uint32_t count) 	{ USB_CDC_TransmitDone(0, count); }
-#endif
-#if (USB_CDC_COUNT > 1)
-static void USB_CDC_Receive1(uint32_t count) 		{ USB_CDC_Receive(1, count); }
-static void USB_CDC_TransmitDone1(uint32_t count)	{ USB_CDC_TransmitDone(1, count); }
-#endif
-#if (USB_CDC_COUNT > 2)
-static void USB_CDC_Receive2(uint32_t count) 		{ USB_CDC_Receive(2, count); }
-static void USB_CDC_TransmitDone2(uint32_t count)	{ USB_CDC_TransmitDone(2, count); }
-#endif
+static void USB_CDC_NotifyNext(uint8_t port)
+{
+	CDC_t * cdc = gCDC + port;
+	if (!cdc->notifyPending)
+	{
+		cdc->notifyBusy = false;
+		return;
+	}
+
+	uint16_t state = cdc->serialState;
+	// Events are only reported once. The held bits remain.
+	cdc->serialState &= ~CDC_STATE_EVENTS;
+	cdc->notifyPending = false;
+
+	uint8_t interface = USB_CDC_INTERFACE_BASE + (port * 2);
+	uint8_t * notify = cdc->notify;
+	notify[0] = CDC_NOTIFY_REQUEST_TYPE;
+	notify[1] = CDC_NOTIFY_SERIAL_STATE;
+	notify[2] = 0;			// wValue
+	notify[3] = 0;
+	notify[4] = interface;	// wIndex
+	notify[5] = 0;
+	notify[6] = 2;			// wLength
+	notify[7] = 0;
+	notify[8] = LOBYTE(state);
+	notify[9] = HIBYTE(state);
+
+	cdc->notifyBusy = true;
+	USB_EP_Write(CDC_CMD_EP(port), notify, CDC_NOTIFY_SIZE);
+}
+
+static void USB_CDC_NotifyDone(uint8_t port, uint32_t count)
+{
+	// Send any state change that occurred while we were busy.
+	USB_CDC_NotifyNext(port);
+}
 
+#define CDC_PORT_TRAMPOLINES(n, rx, tx)	\
+	static void USB_CDC_Receive##n(uint32_t count)			{ USB_CDC_Receive(n, count); } \
+	static void USB_CDC_TransmitDone##n(uint32_t count)		{ USB_CDC_TransmitDone(n, count); } \
+	static void USB_CDC_NotifyDone##n(uint32_t count)		{ USB_CDC_NotifyDone(n, count); } \
+	static void USB_CDC_CtlRxReady##n(void)					{ USB_CDC_CtlRxReady(n); }
+USB_CDC_PORTS(CDC_PORT_TRAMPOLINES)
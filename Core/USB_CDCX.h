@@ -8,10 +8,89 @@
  * PUBLIC DEFINITIONS
  */
 
+// The CDC port table. Each PORT(n, rx, tx) entry generates a CDC function with its own
+// descriptor, endpoints and buffers. Entries must be numbered from 0.
+// The rx and tx buffer sizes must be powers of two.
+#ifndef USB_CDC_PORTS
+#define USB_CDC_PORTS(PORT)			PORT(0, 512, 512)
+#endif
+
+#define USB_CDC_PORT_COUNT(n, rx, tx)	+ 1
+#define USB_CDC_COUNT				(0 USB_CDC_PORTS(USB_CDC_PORT_COUNT))
+
+// Each port uses a comms and data interface, and a data and command endpoint.
+#define USB_CDCX_INTERFACES			(USB_CDC_COUNT * 2)
+#define USB_CDCX_ENDPOINTS			(USB_CDC_COUNT * 2)
+
+#define USB_CDCX_CMD_PACKET_SIZE	16
+
+// Packet memory used by each port. The data endpoints are single buffered: a double buffered
+// bulk endpoint is one way and takes a whole endpoint register, but each port shares one
+// endpoint number between its IN and OUT data endpoints, and only 8 registers exist.
+#define USB_CDC_PORT_PMA(n, rx, tx)	+ 2 * USB_PACKET_SIZE + USB_CDCX_CMD_PACKET_SIZE
+#define USB_CDCX_PMA_SIZE			(0 USB_CDC_PORTS(USB_CDC_PORT_PMA))
+
+#define USB_CDCX_PORT_DESC_SIZE		66
+#define USB_CDCX_DESC_SIZE			(USB_CDC_COUNT * USB_CDCX_PORT_DESC_SIZE)
+
+#define USB_CDCX_PORT_DESC(_interface, _endpoint) \
+	USB_DESC_BLOCK_INTERFACE_ASSOCIATION(_interface, 2, 2, 2, 0), \
+	USB_DESCR_BLOCK_INTERFACE(_interface, 0x01, 0x02, 0x02, 0x01), \
+	0x05, 0x24, 0x00, 0x10, 0x01,				/* Header functional descriptor */ \
+	0x05, 0x24, 0x01, 0x00, (_interface) + 1,	/* Call management functional descriptor */ \
+	0x04, 0x24, 0x02, 0x06,						/* ACM functional descriptor: line coding, break */ \
+	0x05, 0x24, 0x06, (_interface), (_interface) + 1, /* Union functional descriptor */ \
+	USB_DESCR_BLOCK_ENDPOINT(((_endpoint) + 1) | 0x80, 0x03, USB_CDCX_CMD_PACKET_SIZE, 0x10), \
+	USB_DESCR_BLOCK_INTERFACE((_interface) + 1, 0x02, 0x0A, 0x00, 0x00), \
+	USB_DESCR_BLOCK_ENDPOINT((_endpoint), 0x02, USB_PACKET_SIZE, 0x00), \
+	USB_DESCR_BLOCK_ENDPOINT((_endpoint) | 0x80, 0x02, USB_PACKET_SIZE, 0x00)
+
 /*
  * PUBLIC TYPES
  */
 
+// SERIAL_STATE bits, as sent on the notification endpoint.
+// DCD and DSR are held. The remaining bits are events, and are only reported once.
+typedef enum {
+	USB_CDCX_State_DCD 		= (1 << 0),
+	USB_CDCX_State_DSR 		= (1 << 1),
+	USB_CDCX_State_Break	= (1 << 2),
+	USB_CDCX_State_Ring		= (1 << 3),
+	USB_CDCX_State_Framing	= (1 << 4),
+	USB_CDCX_State_Parity	= (1 << 5),
+	USB_CDCX_State_Overrun	= (1 << 6),
+} USB_CDCX_State_t;
+
+// Control line bits, as set by SET_CONTROL_LINE_STATE
+typedef enum {
+	USB_CDCX_Control_DTR	= (1 << 0),
+	USB_CDCX_Control_RTS	= (1 << 1),
+} USB_CDCX_Control_t;
+
+typedef struct {
+	uint32_t baud;
+	uint8_t stop_bits;		// 0: 1, 1: 1.5, 2: 2
+	uint8_t parity;			// 0: None, 1: Odd, 2: Even, 3: Mark, 4: Space
+	uint8_t data_bits;
+} USB_CDCX_LineCoding_t;
+
+typedef struct {
+	uint32_t rx_packets;
+	uint32_t rx_bytes;
+	uint32_t rx_direct;		// OUT packets read directly into the rx buffer
+	uint32_t rx_bounced;	// OUT packets copied in via the packet buffer
+	uint32_t rx_dropped;	// Bytes discarded by the receive callback
+	uint32_t rx_peak;		// Maximum rx buffer occupancy
+	uint32_t rx_held_ms;	// Time the OUT endpoint spent NAKing on a full buffer
+	uint32_t tx_packets;
+	uint32_t tx_bytes;
+	uint32_t tx_zlps;
+	uint32_t tx_rejected;	// Bytes refused by USB_CDCX_Write on a full buffer
+	uint32_t tx_peak;		// Maximum tx buffer occupancy
+} USB_CDCX_Stats_t;
+
+typedef void (*USB_CDCX_Callback_t)(uint8_t port);
+
 /*
  * PUBLIC FUNCTIONS
  */
@@ -21,12 +100,55 @@
 void USB_CDCX_Init(uint8_t config);
 void USB_CDCX_Deinit(void);
 void USB_CDCX_Setup(uint8_t port, USB_SetupRequest_t * req);
+void USB_CDCX_SOF(void);
 
 // Interface to user
 uint32_t USB_CDCX_ReadReady(uint8_t port);
 uint32_t USB_CDCX_Read(uint8_t port, uint8_t * data, uint32_t count);
-void USB_CDCX_Write(uint8_t port, const uint8_t * data, uint32_t count);
-void USB_CDCX_WriteStr(uint8_t port, const char * str);
+
+// Exposes the largest continuous span of received data without copying it.
+// The span remains valid until it is released with USB_CDCX_Consume.
+uint32_t USB_CDCX_Peek(uint8_t port, const uint8_t ** data);
+void USB_CDCX_Consume(uint8_t port, uint32_t count);
+
+// Called from the USB interrupt when data is received, so that it can be consumed from another interrupt.
+// Pass NULL to remove the callback.
+void USB_CDCX_OnReceive(uint8_t port, USB_CDCX_Callback_t callback);
+// Called from the USB interrupt just before a bus reset or reconfiguration empties the buffers.
+// Anything still reading from a peeked span must stop here.
+void USB_CDCX_OnReset(uint8_t port, USB_CDCX_Callback_t callback);
+
+// True while the host has the port open, as signalled by DTR.
+bool USB_CDCX_IsOpen(uint8_t port);
+
+// Writes are buffered and do not block. These return the number of bytes accepted.
+// These may be called from interrupts, or with interrupts masked.
+uint32_t USB_CDCX_WriteReady(uint8_t port);
+uint32_t USB_CDCX_Write(uint8_t port, const uint8_t * data, uint32_t count);
+uint32_t USB_CDCX_WriteStr(uint8_t port, const char * str);
+
+// Short writes are coalesced for up to this many frames (ms) before being sent.
+// Zero sends data immediately.
+void USB_CDCX_SetLatency(uint8_t port, uint8_t frames);
+
+// Full packets are sent as 64 bytes, rather than the 63 byte default that windows needs.
+// The initial mode is set by USB_CDC_FULL_PACKET_PORTS.
+void USB_CDCX_SetFullPackets(uint8_t port, bool enable);
+bool USB_CDCX_GetFullPackets(uint8_t port);
+
+void USB_CDCX_GetStats(uint8_t port, USB_CDCX_Stats_t * stats);
+void USB_CDCX_ResetStats(uint8_t port);
+
+// These return true once for each change made by the host.
+bool USB_CDCX_PollLineCoding(uint8_t port, USB_CDCX_LineCoding_t * coding);
+bool USB_CDCX_PollControlLines(uint8_t port, USB_CDCX_Control_t * lines);
+// The duration is in ms. 0xFFFF holds the break until a duration of 0 is received.
+bool USB_CDCX_PollBreak(uint8_t port, uint16_t * duration);
+
+// Sends a SERIAL_STATE notification if the state has changed. Safe to call from interrupts.
+void USB_CDCX_SetSerialState(uint8_t port, USB_CDCX_State_t state);
+// Reports one-shot events, such as a received break or a framing error, alongside the held state.
+void USB_CDCX_SignalEvents(uint8_t port, USB_CDCX_State_t events);
 
 /*
  * EXTERN DECLARATIONS
@@ -4,11 +4,28 @@
 #ifdef USB_CLASS_COMPOSITE
 
 #include "USB_CDCX.h"
+#include "Core.h"
 
 /*
  * PRIVATE DEFINITIONS
  */
 
+#define USB_REQ_TYPE_MASK			0x60
+#define USB_REQ_TYPE_VENDOR			0x40
+
+// PMA allocation plan. The BTABLE, EP0 and every class endpoint must fit in the packet memory.
+#define USB_PMA_SIZE				1024
+#define USB_PMA_BTABLE_SIZE			(8 * 8)
+#define USB_PMA_EP0_SIZE			(2 * USB_PACKET_SIZE)
+#define USB_PMA_USED				(USB_PMA_BTABLE_SIZE + USB_PMA_EP0_SIZE + USB_CDCX_PMA_SIZE + USB_COMPOSITE_VENDOR_PMA_SIZE)
+
+#if (USB_PMA_USED > USB_PMA_SIZE)
+#error "USB endpoints do not fit in the PMA"
+#endif
+
+// Resume signalling must be held between 1 and 15 ms.
+#define USB_RESUME_SIGNAL_MS		5
+
 /*
  * PRIVATE TYPES
  */
@@ -21,82 +38,160 @@
  * PRIVATE VARIABLES
  */
 
-__ALIGNED(4) const uint8_t cUSB_Composite_ConfigDescriptor[USB_COMPOSITE_CONFIG_DESC_SIZE] =
+static volatile bool gSuspended;
+static volatile bool gRemoteWakeup;
+static bool gResuming;
+static uint32_t gResumeTick;
+
+#define CDC_PORT_DESC(n, rx, tx)	USB_CDCX_PORT_DESC(USB_CDC_INTERFACE_BASE + (n) * 2, USB_CDC_ENDPOINT_BASE + (n) * 2),
+
+__ALIGNED(4) const uint8_t cUSB_Composite_ConfigDescriptor[] =
 {
-	USB_DESCR_BLOCK_CONFIGURATION(USB_COMPOSITE_CONFIG_DESC_SIZE, USB_COMPOSITE_INTERFACES, 0x01),
-	// USB_CDC[0]
-	USB_DESC_BLOCK_INTERFACE_ASSOCIATION(0, 2, 2, 2, 0),
-	USB_DESCR_BLOCK_INTERFACE(0,0x01,0x02,0x02,0x01),
-	0x05,0x24,0x00,0x10,
-	0x01,0x05,0x24,0x01,
-	0x00,0x01,0x04,0x24,
-	0x02,0x02,0x05,0x24,
-	0x06,0x00,0x01,
-	USB_DESCR_BLOCK_ENDPOINT(((1+1)|0x80),0x03,8,0x10),
-	USB_DESCR_BLOCK_INTERFACE(0+1,0x02,0x0A,0x00,0x00),
-	USB_DESCR_BLOCK_ENDPOINT((1+0),0x02,USB_PACKET_SIZE,0x00),
-	USB_DESCR_BLOCK_ENDPOINT(((1+0)|0x80),0x02,USB_PACKET_SIZE,0x00),
-	// USB_CDC[1]
-	USB_DESC_BLOCK_INTERFACE_ASSOCIATION(2, 2, 2, 2, 0),
-	USB_DESCR_BLOCK_INTERFACE(2,0x01,0x02,0x02,0x01),
-	0x05,0x24,0x00,0x10,
-	0x01,0x05,0x24,0x01,
-	0x00,0x03,0x04,0x24,
-	0x02,0x02,0x05,0x24,
-	0x06,0x02,0x03,
-	USB_DESCR_BLOCK_ENDPOINT(((3+1)|0x80),0x03,8,0x10),
-	USB_DESCR_BLOCK_INTERFACE(2+1,0x02,0x0A,0x00,0x00),
-	USB_DESCR_BLOCK_ENDPOINT((3+0),0x02,USB_PACKET_SIZE,0x00),
-	USB_DESCR_BLOCK_ENDPOINT(((3+0)|0x80),0x02,USB_PACKET_SIZE,0x00),
-	// USB_CDC[2]
-	USB_DESC_BLOCK_INTERFACE_ASSOCIATION(4, 2, 2, 2, 0),
-	USB_DESCR_BLOCK_INTERFACE(4,0x01,0x02,0x02,0x01),
-	0x05,0x24,0x00,0x10,
-	0x01,0x05,0x24,0x01,
-	0x00,0x05,0x04,0x24,
-	0x02,0x02,0x05,0x24,
-	0x06,0x04,0x05,
-	USB_DESCR_BLOCK_ENDPOINT(((5+1)|0x80),0x03,8,0x10),
-	USB_DESCR_BLOCK_INTERFACE(4+1,0x02,0x0A,0x00,0x00),
-	USB_DESCR_BLOCK_ENDPOINT((5+0),0x02,USB_PACKET_SIZE,0x00),
-	USB_DESCR_BLOCK_ENDPOINT(((5+0)|0x80),0x02,USB_PACKET_SIZE,0x00),
+	USB_COMPOSITE_CONFIG_HEADER(USB_COMPOSITE_RUNTIME_DESC_SIZE, USB_COMPOSITE_INTERFACES, 0x01),
+	USB_CDC_PORTS(CDC_PORT_DESC)
+#ifdef USB_VENDOR_ENABLE
+	USB_VENDOR_DESC(USB_VENDOR_INTERFACE_BASE, USB_VENDOR_ENDPOINT_BASE),
+#endif
+	USB_DFU_DESC(USB_DFU_INTERFACE_BASE, USB_DFU_PROTOCOL_RUNTIME),
 };
 
+_Static_assert(sizeof(cUSB_Composite_ConfigDescriptor) == USB_COMPOSITE_RUNTIME_DESC_SIZE, "Composite descriptor size mismatch");
+_Static_assert(USB_COMPOSITE_ENDPOINTS <= 8, "Too many endpoints for the USB peripheral");
+
 /*
  * PUBLIC FUNCTIONS
  */
 
 void USB_Composite_Init(uint8_t config)
 {
+	USB_DFU_Init(config);
+	if (USB_DFU_IsDetached())
+	{
+		return;
+	}
 	USB_CDCX_Init(config);
+#ifdef USB_VENDOR_ENABLE
+	USB_Vendor_Init(config);
+#endif
 }
 
 void USB_Composite_Deinit(void)
 {
+	// A bus reset deinitialises the class, and disables remote wakeup.
+	gRemoteWakeup = false;
+	USB_DFU_Deinit();
+	if (USB_DFU_IsDetached())
+	{
+		return;
+	}
 	USB_CDCX_Deinit();
+#ifdef USB_VENDOR_ENABLE
+	USB_Vendor_Deinit();
+#endif
 }
 
 void USB_Composite_Setup(USB_SetupRequest_t * req)
 {
+	// In DFU mode, every request is for the DFU interface.
+	if (USB_DFU_IsDetached())
+	{
+		USB_DFU_Setup(req);
+		return;
+	}
+
+#ifdef USB_VENDOR_ENABLE
+	// Vendor requests name their channel rather than their interface.
+	if ((req->bmRequest & USB_REQ_TYPE_MASK) == USB_REQ_TYPE_VENDOR)
+	{
+		USB_Vendor_Setup(req);
+		return;
+	}
+#endif
+
 	uint8_t interface = LOBYTE(req->wIndex);
-	
-    if (interface < 2)
-    {
-        USB_CDCX_Setup(0, req);
-    }
-    else if (interface < 4)
-    {
-        USB_CDCX_Setup(1, req);
-    }
-    else if (interface < 6)
-    {
-        USB_CDCX_Setup(2, req);
-    }
+
+	// Interfaces below the base wrap around, and are rejected here too.
+	uint8_t cdc_interface = interface - USB_CDC_INTERFACE_BASE;
+	if (cdc_interface < USB_CDCX_INTERFACES)
+	{
+		// Each CDC port owns a pair of interfaces
+		USB_CDCX_Setup(cdc_interface / 2, req);
+	}
+	else if (interface == USB_DFU_INTERFACE_BASE)
+	{
+		USB_DFU_Setup(req);
+	}
 }
 
-/*
- * PRIVATE FUNCTIONS
- */
+void USB_Composite_SOF(void)
+{
+	if (!USB_DFU_IsDetached())
+	{
+		USB_CDCX_SOF();
+	}
+}
+
+void USB_Composite_Suspend(void)
+{
+	// Force suspend first, then low power mode, as RM0091 requires.
+	USB->CNTR |= USB_CNTR_FSUSP;
+	USB->CNTR |= USB_CNTR_LPMODE;
+	gSuspended = true;
+}
+
+void USB_Composite_Resume(void)
+{
+	// Hardware clears LPMODE on wakeup, but FSUSP is ours to clear.
+	USB->CNTR &= ~(USB_CNTR_LPMODE | USB_CNTR_FSUSP);
+	gSuspended = false;
+}
+
+void USB_Composite_SetRemoteWakeup(bool enable)
+{
+	gRemoteWakeup = enable;
+}
+
+bool USB_Composite_IsSuspended(void)
+{
+	return gSuspended;
+}
+
+bool USB_Composite_RemoteWakeup(void)
+{
+	if (!gSuspended || !gRemoteWakeup || gResuming)
+	{
+		return false;
+	}
+
+	// The peripheral must be out of low power mode before it can drive the bus.
+	// USB_Composite_Poll ends the signalling.
+	// CNTR is also written from the USB interrupt, so this must not be interrupted.
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	USB->CNTR &= ~(USB_CNTR_FSUSP | USB_CNTR_LPMODE);
+	USB->CNTR |= USB_CNTR_RESUME;
+	__set_PRIMASK(primask);
+	gResumeTick = CORE_GetTick();
+	gResuming = true;
+	return true;
+}
+
+bool USB_Composite_IsResuming(void)
+{
+	return gResuming;
+}
+
+void USB_Composite_Poll(void)
+{
+	if (gResuming && CORE_GetTick() - gResumeTick >= USB_RESUME_SIGNAL_MS)
+	{
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		USB->CNTR &= ~USB_CNTR_RESUME;
+		__set_PRIMASK(primask);
+		gResuming = false;
+	}
+}
 
 #endif //USB_CLASS_COMPOSITE
 
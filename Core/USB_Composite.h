@@ -8,19 +8,52 @@
  * PUBLIC DEFINITIONS
  */
 
-#define USB_COMPOSITE_INTERFACES			6
-#define USB_COMPOSITE_ENDPOINTS				7
+#define USB_CDC_INTERFACE_BASE				0
+#define USB_CDC_ENDPOINT_BASE				1
+
+#include "USB_CDCX.h"
+
+// The optional vendor interface follows the CDC ports.
+#define USB_VENDOR_INTERFACE_BASE			(USB_CDC_INTERFACE_BASE + USB_CDCX_INTERFACES)
+#define USB_VENDOR_ENDPOINT_BASE			(USB_CDC_ENDPOINT_BASE + USB_CDCX_ENDPOINTS)
+
+#ifdef USB_VENDOR_ENABLE
+#include "USB_Vendor.h"
+#define USB_COMPOSITE_VENDOR_INTERFACES		USB_VENDOR_INTERFACES
+#define USB_COMPOSITE_VENDOR_ENDPOINTS		USB_VENDOR_ENDPOINTS
+#define USB_COMPOSITE_VENDOR_DESC_SIZE		USB_VENDOR_DESC_SIZE
+#define USB_COMPOSITE_VENDOR_PMA_SIZE		USB_VENDOR_PMA_SIZE
+#else
+#define USB_COMPOSITE_VENDOR_INTERFACES		0
+#define USB_COMPOSITE_VENDOR_ENDPOINTS		0
+#define USB_COMPOSITE_VENDOR_DESC_SIZE		0
+#define USB_COMPOSITE_VENDOR_PMA_SIZE		0
+#endif
+
+// The DFU runtime interface is last. It has no endpoints.
+#include "USB_DFU.h"
+#define USB_DFU_INTERFACE_BASE				(USB_VENDOR_INTERFACE_BASE + USB_COMPOSITE_VENDOR_INTERFACES)
 
-#define USB_COMPOSITE_CONFIG_DESC_SIZE		207
-#define USB_COMPOSITE_CONFIG_DESC			cUSB_Composite_ConfigDescriptor
+#define USB_COMPOSITE_INTERFACES			(USB_DFU_INTERFACE_BASE + USB_DFU_INTERFACES)
+#define USB_COMPOSITE_ENDPOINTS				(USB_VENDOR_ENDPOINT_BASE + USB_COMPOSITE_VENDOR_ENDPOINTS + USB_DFU_ENDPOINTS)
+
+#define USB_COMPOSITE_CONFIG_HEADER_SIZE	9
+// bmAttributes: self powered, remote wakeup. bMaxPower: 100mA
+#define USB_COMPOSITE_ATTRIBUTES			0xE0
+#define USB_COMPOSITE_MAX_POWER				0x32
+#define USB_COMPOSITE_CONFIG_HEADER(_size, _interfaces, _config) \
+	0x09, 0x02, LOBYTE(_size), HIBYTE(_size), (_interfaces), (_config), 0x00, \
+	USB_COMPOSITE_ATTRIBUTES, USB_COMPOSITE_MAX_POWER
+#define USB_COMPOSITE_RUNTIME_DESC_SIZE		(USB_COMPOSITE_CONFIG_HEADER_SIZE + USB_CDCX_DESC_SIZE + USB_COMPOSITE_VENDOR_DESC_SIZE + USB_DFU_DESC_SIZE)
+
+// The configuration served to the host. After a DFU detach, only the DFU interface is presented.
+#define USB_COMPOSITE_CONFIG_DESC			(USB_DFU_IsDetached() ? cUSB_DFU_ModeDescriptor : cUSB_Composite_ConfigDescriptor)
+#define USB_COMPOSITE_CONFIG_DESC_SIZE		(USB_DFU_IsDetached() ? USB_DFU_MODE_DESC_SIZE : USB_COMPOSITE_RUNTIME_DESC_SIZE)
 
 #define USB_COMPOSITE_CLASSID				0xEF
 #define USB_COMPOSITE_SUBCLASSID			0x02
 #define USB_COMPOSITE_PROTOCOLID			0x01
 
-#define USB_CDC_INTERFACE_BASE				0
-#define USB_CDC_ENDPOINT_BASE				1
-
 /*
  * PUBLIC TYPES
  */
@@ -34,12 +67,26 @@
 void USB_Composite_Init(uint8_t config);
 void USB_Composite_Deinit(void);
 void USB_Composite_Setup(USB_SetupRequest_t * req);
+// These are called from the USB interrupt, once the driver has cleared the flag.
+// SOF is only enabled while a CDC port holds back data for its latency.
+void USB_Composite_SOF(void);
+void USB_Composite_Suspend(void);
+void USB_Composite_Resume(void);
+// Called when the host sets or clears DEVICE_REMOTE_WAKEUP.
+void USB_Composite_SetRemoteWakeup(bool enable);
+
+bool USB_Composite_IsSuspended(void);
+// Starts signalling resume to the host. Returns false unless suspended, and the host has enabled remote wakeup.
+// The signalling is ended by USB_Composite_Poll, which must be called from the main loop.
+bool USB_Composite_RemoteWakeup(void);
+bool USB_Composite_IsResuming(void);
+void USB_Composite_Poll(void);
 
 /*
  * EXTERN DECLARATIONS
  */
 
-extern const uint8_t cUSB_Composite_ConfigDescriptor[USB_COMPOSITE_CONFIG_DESC_SIZE];
+extern const uint8_t cUSB_Composite_ConfigDescriptor[];
 
 
 #endif // USB_COMPOSITE_H
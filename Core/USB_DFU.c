@@ -0,0 +1,294 @@
+// The DFU interface is only available as part of the composite device.
+#include "USB_Composite.h"
+
+#ifdef USB_CLASS_COMPOSITE
+
+#include "usb/USB_CTL.h"
+#include "Updater.h"
+#include "Core.h"
+
+/*
+ * PRIVATE DEFINITIONS
+ */
+
+#define DFU_DETACH							0x00
+#define DFU_DNLOAD							0x01
+#define DFU_UPLOAD							0x02
+#define DFU_GETSTATUS						0x03
+#define DFU_CLRSTATUS						0x04
+#define DFU_GETSTATE						0x05
+#define DFU_ABORT							0x06
+
+#define DFU_STATUS_SIZE						6
+#define DFU_STATUS_ERR_STALLEDPKT			0x0F
+
+// A page erase takes up to 40ms, and programming a block up to 10ms. The first block also erases the header page.
+// The host waits this long before polling again.
+#define DFU_BUSY_TIMEOUT					100
+#define DFU_PROGRAM_TIMEOUT					10
+// Lets the final GETSTATUS complete before the device resets.
+#define DFU_RESET_DELAY						20
+
+/*
+ * PRIVATE TYPES
+ */
+
+typedef enum {
+	DFU_State_AppIdle = 0,
+	DFU_State_AppDetach,
+	DFU_State_Idle,
+	DFU_State_DnloadSync,
+	DFU_State_DnBusy,
+	DFU_State_DnloadIdle,
+	DFU_State_ManifestSync,
+	DFU_State_Manifest,
+	DFU_State_ManifestWaitReset,
+	DFU_State_UploadIdle,
+	DFU_State_Error,
+} DFU_State_t;
+
+typedef struct {
+	bool mode;
+	volatile bool detach;
+	volatile bool blockReady;		// A block has been received, and is waiting to be programmed
+	volatile bool manifest;			// The image is complete, and is waiting to be checked
+	volatile bool reset;
+	DFU_State_t state;
+	volatile uint8_t status;
+	uint16_t block;
+	uint16_t size;
+	uint8_t reply[8];
+	uint32_t data[USB_DFU_TRANSFER_SIZE/4];
+} DFU_t;
+
+/*
+ * PRIVATE PROTOTYPES
+ */
+
+static void USB_DFU_Download(USB_SetupRequest_t * req);
+static void USB_DFU_DownloadReady(void);
+static void USB_DFU_GetStatus(void);
+static void USB_DFU_Fail(uint8_t status);
+
+/*
+ * PRIVATE VARIABLES
+ */
+
+__ALIGNED(4) const uint8_t cUSB_DFU_ModeDescriptor[] =
+{
+	USB_DESCR_BLOCK_CONFIGURATION(USB_DFU_MODE_DESC_SIZE, 1, 0x01),
+	USB_DFU_DESC(0, USB_DFU_PROTOCOL_MODE),
+};
+
+_Static_assert(sizeof(cUSB_DFU_ModeDescriptor) == USB_DFU_MODE_DESC_SIZE, "DFU descriptor size mismatch");
+_Static_assert(UPDATER_PAGE_SIZE % USB_DFU_TRANSFER_SIZE == 0, "DFU blocks must not cross a flash page");
+
+static DFU_t gDFU;
+
+/*
+ * PUBLIC FUNCTIONS
+ */
+
+void USB_DFU_Init(uint8_t config)
+{
+	gDFU.state = gDFU.mode ? DFU_State_Idle : DFU_State_AppIdle;
+	// The runtime status reports an install that the boot gave up on, until a new image is staged.
+	gDFU.status = gDFU.mode ? Updater_Status_Ok : Updater_GetInstallStatus();
+	gDFU.detach = false;
+	gDFU.blockReady = false;
+	gDFU.manifest = false;
+}
+
+void USB_DFU_Deinit(void)
+{
+}
+
+void USB_DFU_Setup(USB_SetupRequest_t * req)
+{
+	switch (req->bRequest)
+	{
+	case DFU_DETACH:
+		if (!gDFU.mode)
+		{
+			gDFU.state = DFU_State_AppDetach;
+			gDFU.detach = true;
+		}
+		break;
+	case DFU_DNLOAD:
+		USB_DFU_Download(req);
+		break;
+	case DFU_GETSTATUS:
+		USB_DFU_GetStatus();
+		USB_CTL_Send(gDFU.reply, req->wLength < DFU_STATUS_SIZE ? req->wLength : DFU_STATUS_SIZE);
+		break;
+	case DFU_CLRSTATUS:
+		if (gDFU.state == DFU_State_Error)
+		{
+			gDFU.state = DFU_State_Idle;
+			gDFU.status = Updater_Status_Ok;
+		}
+		break;
+	case DFU_GETSTATE:
+		gDFU.reply[0] = gDFU.state;
+		USB_CTL_Send(gDFU.reply, 1);
+		break;
+	case DFU_ABORT:
+		// The staged image is not valid until it is manifested, so it can just be abandoned.
+		if (gDFU.state == DFU_State_DnloadIdle || gDFU.state == DFU_State_ManifestSync)
+		{
+			gDFU.state = DFU_State_Idle;
+		}
+		break;
+	default:
+		// Upload is not supported.
+		USB_DFU_Fail(DFU_STATUS_ERR_STALLEDPKT);
+		break;
+	}
+}
+
+bool USB_DFU_PollDetach(void)
+{
+	if (gDFU.detach)
+	{
+		gDFU.detach = false;
+		return true;
+	}
+	return false;
+}
+
+void USB_DFU_EnterMode(void)
+{
+	gDFU.mode = true;
+}
+
+bool USB_DFU_IsDetached(void)
+{
+	return gDFU.mode;
+}
+
+void USB_DFU_Poll(void)
+{
+	if (gDFU.blockReady)
+	{
+		// The first block starts a new image.
+		if (gDFU.block == 0)
+		{
+			Updater_Begin();
+		}
+		gDFU.status = Updater_Write(gDFU.block * USB_DFU_TRANSFER_SIZE, (uint8_t *)gDFU.data, gDFU.size);
+		gDFU.blockReady = false;
+	}
+	if (gDFU.manifest)
+	{
+		gDFU.status = Updater_Finish();
+		gDFU.manifest = false;
+	}
+	if (gDFU.reset)
+	{
+		// The boot installs the staged image.
+		CORE_Delay(DFU_RESET_DELAY);
+		NVIC_SystemReset();
+	}
+}
+
+/*
+ * PRIVATE FUNCTIONS
+ */
+
+static void USB_DFU_Download(USB_SetupRequest_t * req)
+{
+	if (!gDFU.mode || (gDFU.state != DFU_State_Idle && gDFU.state != DFU_State_DnloadIdle))
+	{
+		USB_DFU_Fail(DFU_STATUS_ERR_STALLEDPKT);
+		return;
+	}
+
+	if (req->wLength == 0)
+	{
+		// A zero length download ends the image.
+		if (gDFU.state == DFU_State_DnloadIdle)
+		{
+			gDFU.state = DFU_State_ManifestSync;
+			gDFU.manifest = true;
+		}
+		else
+		{
+			USB_DFU_Fail(DFU_STATUS_ERR_STALLEDPKT);
+		}
+		return;
+	}
+
+	if (req->wLength > USB_DFU_TRANSFER_SIZE)
+	{
+		USB_DFU_Fail(DFU_STATUS_ERR_STALLEDPKT);
+		return;
+	}
+	gDFU.block = req->wValue;
+	gDFU.size = req->wLength;
+	USB_CTL_Receive((uint8_t *)gDFU.data, req->wLength, USB_DFU_DownloadReady);
+}
+
+static void USB_DFU_DownloadReady(void)
+{
+	gDFU.state = DFU_State_DnloadSync;
+	gDFU.blockReady = true;
+}
+
+static void USB_DFU_GetStatus(void)
+{
+	uint32_t timeout = 0;
+	switch (gDFU.state)
+	{
+	case DFU_State_DnloadSync:
+	case DFU_State_DnBusy:
+		if (gDFU.blockReady)
+		{
+			gDFU.state = DFU_State_DnBusy;
+			// Only the first block in each page waits for an erase.
+			timeout = (gDFU.block * USB_DFU_TRANSFER_SIZE) % UPDATER_PAGE_SIZE ? DFU_PROGRAM_TIMEOUT : DFU_BUSY_TIMEOUT;
+		}
+		else
+		{
+			gDFU.state = gDFU.status == Updater_Status_Ok ? DFU_State_DnloadIdle : DFU_State_Error;
+		}
+		break;
+	case DFU_State_ManifestSync:
+	case DFU_State_Manifest:
+		if (gDFU.manifest)
+		{
+			gDFU.state = DFU_State_Manifest;
+			timeout = DFU_BUSY_TIMEOUT;
+		}
+		else if (gDFU.status == Updater_Status_Ok)
+		{
+			// We are not manifestation tolerant. The host sees dfuMANIFEST, then we reset.
+			gDFU.state = DFU_State_ManifestWaitReset;
+			gDFU.reset = true;
+		}
+		else
+		{
+			gDFU.state = DFU_State_Error;
+		}
+		break;
+	default:
+		break;
+	}
+
+	gDFU.reply[0] = gDFU.status;
+	gDFU.reply[1] = LOBYTE(timeout);
+	gDFU.reply[2] = HIBYTE(timeout);
+	gDFU.reply[3] = 0;
+	// The reset is reported as manifestation, as the host expects.
+	gDFU.reply[4] = gDFU.state == DFU_State_ManifestWaitReset ? DFU_State_Manifest : gDFU.state;
+	gDFU.reply[5] = 0;
+}
+
+static void USB_DFU_Fail(uint8_t status)
+{
+	// The request is stalled, and the reason is left for the next DFU_GETSTATUS.
+	gDFU.state = DFU_State_Error;
+	gDFU.status = status;
+	USB_CTL_Stall();
+}
+
+#endif //USB_CLASS_COMPOSITE
@@ -0,0 +1,67 @@
+#ifndef USB_DFU_H
+#define USB_DFU_H
+
+#include "STM32X.h"
+#include "usb/USB_Defs.h"
+
+/*
+ * PUBLIC DEFINITIONS
+ */
+
+// Blocks are kept small, as the buffer is held for as long as the interface exists.
+// A flash page takes several blocks, and must be a whole number of them.
+#define USB_DFU_TRANSFER_SIZE				256
+#define USB_DFU_DETACH_TIMEOUT				1000
+
+#define USB_DFU_INTERFACES					1
+#define USB_DFU_ENDPOINTS					0
+
+// bmAttributes: bitCanDnload, bitWillDetach. The device resets itself after manifestation.
+#define USB_DFU_ATTRIBUTES					0x09
+
+#define USB_DFU_PROTOCOL_RUNTIME			0x01
+#define USB_DFU_PROTOCOL_MODE				0x02
+
+#define USB_DFU_DESC_SIZE					18
+
+#define USB_DFU_DESC(_interface, _protocol) \
+	USB_DESCR_BLOCK_INTERFACE(_interface, 0x00, 0xFE, 0x01, _protocol), \
+	0x09, 0x21, USB_DFU_ATTRIBUTES, \
+	LOBYTE(USB_DFU_DETACH_TIMEOUT), HIBYTE(USB_DFU_DETACH_TIMEOUT), \
+	LOBYTE(USB_DFU_TRANSFER_SIZE), HIBYTE(USB_DFU_TRANSFER_SIZE), \
+	0x10, 0x01
+
+// In DFU mode the DFU interface is the only one in the configuration.
+#define USB_DFU_MODE_DESC_SIZE				(9 + USB_DFU_DESC_SIZE)
+
+/*
+ * PUBLIC TYPES
+ */
+
+/*
+ * PUBLIC FUNCTIONS
+ */
+
+// Callbacks for USB_CTL.
+// These should be referenced in USB_Class.h
+void USB_DFU_Init(uint8_t config);
+void USB_DFU_Deinit(void);
+void USB_DFU_Setup(USB_SetupRequest_t * req);
+
+// Returns true once after the host sends DFU_DETACH.
+// The device must then disconnect, and reconnect with USB_DFU_EnterMode set.
+bool USB_DFU_PollDetach(void);
+void USB_DFU_EnterMode(void);
+bool USB_DFU_IsDetached(void);
+
+// Programs downloaded blocks. This is run from the main loop, because flash erases stall the CPU.
+// The device is reset once a complete image is staged.
+void USB_DFU_Poll(void);
+
+/*
+ * EXTERN DECLARATIONS
+ */
+
+extern const uint8_t cUSB_DFU_ModeDescriptor[];
+
+#endif // USB_DFU_H
@@ -0,0 +1,488 @@
+// The vendor interface is only available as part of the composite device.
+#include "USB_Composite.h"
+
+#ifdef USB_VENDOR_ENABLE
+
+#include "usb/USB_EP.h"
+#include "usb/USB_CTL.h"
+#include "Core.h"
+
+/*
+ * PRIVATE DEFINITIONS
+ */
+
+// Buffer sizes are set per channel in USB_VENDOR_CHANNELS
+#define VND_BFR_WRAP(bfr, v) ((v) & ((bfr)->size - 1))
+#define VND_IS_POW2(v)		(((v) & ((v) - 1)) == 0)
+
+#define VND_IN_EP									(USB_VENDOR_ENDPOINT_BASE | 0x80)
+#define VND_OUT_EP									USB_VENDOR_ENDPOINT_BASE
+
+#define VND_PACKET_SIZE								USB_PACKET_SIZE
+#define VND_CTL_SIZE								8
+
+#define VND_REQ_DIR_MASK							0x80
+#define VND_REQ_DIR_OUT								0x00
+#define VND_REQ_DIR_IN								0x80
+#define VND_REQ_RECIPIENT_MASK						0x1F
+#define VND_REQ_RECIPIENT_INTERFACE					0x01
+
+/*
+ * PRIVATE TYPES
+ */
+
+typedef struct {
+	uint8_t * buffer;
+	uint32_t size;
+	uint32_t head;
+	uint32_t tail;
+} VendorBuffer_t;
+
+typedef struct {
+	uint8_t request;
+	uint8_t direction;	// Direction of the data stage
+	uint8_t size;		// Length of the data stage
+	void (*handler)(uint8_t channel, uint16_t value, uint8_t * data);
+} VendorRequest_t;
+
+// Each channel stages its own control data, as CDC ports do.
+typedef struct {
+	const VendorRequest_t * request;	// Set while waiting for the data stage
+	uint16_t value;
+	// Not sure why this needs to be aligned?
+	uint32_t data[VND_CTL_SIZE/4];
+} VendorCtl_t;
+
+typedef struct {
+	volatile bool open;
+	volatile bool lineCodingChanged;
+	uint8_t lineCoding[7];
+	VendorBuffer_t rx;
+	VendorBuffer_t tx;
+	VendorCtl_t ctl;
+} VendorChannel_t;
+
+typedef struct {
+	volatile bool txBusy;
+	volatile bool rxHeld;
+	uint8_t txNext;
+	uint8_t ctlChannel;		// The channel that owns the control data stage
+	uint8_t rx_packet[VND_PACKET_SIZE];
+	uint8_t tx_packet[VND_PACKET_SIZE];
+} Vendor_t;
+
+/*
+ * PRIVATE PROTOTYPES
+ */
+
+static const VendorRequest_t * USB_Vendor_FindRequest(uint8_t request);
+static void USB_Vendor_CtlRxReady(void);
+static void USB_Vendor_ReceiveNext(void);
+static void USB_Vendor_TransmitNext(void);
+
+static void USB_Vendor_Receive(uint32_t count);
+static void USB_Vendor_TransmitDone(uint32_t count);
+
+static void Vendor_BufferPut(VendorBuffer_t * bfr, const uint8_t * data, uint32_t count);
+static void Vendor_BufferGet(VendorBuffer_t * bfr, uint8_t * data, uint32_t count);
+
+// Vendor request handlers
+static void Vendor_SetLineCoding(uint8_t channel, uint16_t value, uint8_t * data);
+static void Vendor_GetLineCoding(uint8_t channel, uint16_t value, uint8_t * data);
+static void Vendor_SetChannelOpen(uint8_t channel, uint16_t value, uint8_t * data);
+
+/*
+ * PRIVATE VARIABLES
+ */
+
+static const VendorRequest_t cVendor_Requests[] = {
+	{ USB_VENDOR_SET_LINE_CODING,	VND_REQ_DIR_OUT,	7,	Vendor_SetLineCoding },
+	{ USB_VENDOR_GET_LINE_CODING,	VND_REQ_DIR_IN,		7,	Vendor_GetLineCoding },
+	{ USB_VENDOR_SET_CHANNEL_OPEN,	VND_REQ_DIR_OUT,	0,	Vendor_SetChannelOpen },
+};
+
+#define VND_CHANNEL_BUFFERS(n, rx_size, tx_size)	\
+	_Static_assert(VND_IS_POW2(rx_size) && VND_IS_POW2(tx_size), "Vendor buffer sizes must be a power of two"); \
+	_Static_assert((rx_size) > USB_VENDOR_PAYLOAD_MAX, "Vendor rx buffer must be larger than a packet"); \
+	static uint8_t gVendor_RxBuffer##n[rx_size]; \
+	static uint8_t gVendor_TxBuffer##n[tx_size];
+USB_VENDOR_CHANNELS(VND_CHANNEL_BUFFERS)
+
+#define VND_CHANNEL_INIT(n, rx_size, tx_size)	\
+	[n] = { .rx = { .buffer = gVendor_RxBuffer##n, .size = rx_size }, .tx = { .buffer = gVendor_TxBuffer##n, .size = tx_size } },
+static VendorChannel_t gChannels[USB_VENDOR_COUNT] = {
+	USB_VENDOR_CHANNELS(VND_CHANNEL_INIT)
+};
+
+static Vendor_t gVendor;
+
+/*
+ * PUBLIC FUNCTIONS
+ */
+
+void USB_Vendor_Init(uint8_t config)
+{
+	// 115200bps, 1stop, no parity, 8bit
+	const uint8_t lineCoding[] = { 0x00, 0xC2, 0x01, 0x00, 0x00, 0x00, 0x08 };
+
+	for (uint8_t channel = 0; channel < USB_VENDOR_COUNT; channel++)
+	{
+		VendorChannel_t * ch = gChannels + channel;
+		ch->rx.head = ch->rx.tail = 0;
+		ch->tx.head = ch->tx.tail = 0;
+		ch->open = false;
+		ch->lineCodingChanged = false;
+		ch->ctl.request = NULL;
+		memcpy(ch->lineCoding, lineCoding, sizeof(ch->lineCoding));
+	}
+	gVendor.txBusy = false;
+	gVendor.rxHeld = false;
+	gVendor.txNext = 0;
+
+	USB_EP_Open(VND_IN_EP, USB_EP_TYPE_BULK, VND_PACKET_SIZE, USB_Vendor_TransmitDone);
+	USB_EP_Open(VND_OUT_EP, USB_EP_TYPE_BULK, VND_PACKET_SIZE, USB_Vendor_Receive);
+	USB_Vendor_ReceiveNext();
+}
+
+void USB_Vendor_Deinit(void)
+{
+	USB_EP_Close(VND_IN_EP);
+	USB_EP_Close(VND_OUT_EP);
+	for (uint8_t channel = 0; channel < USB_VENDOR_COUNT; channel++)
+	{
+		gChannels[channel].open = false;
+	}
+}
+
+void USB_Vendor_Setup(USB_SetupRequest_t * req)
+{
+	// A new setup abandons any data stage still in progress.
+	gChannels[gVendor.ctlChannel].ctl.request = NULL;
+
+	// Every request is sent to the interface, and names its channel in wValue.
+	// Anything else is stalled, so the host is not left waiting.
+	uint8_t channel = LOBYTE(req->wValue);
+	const VendorRequest_t * request = USB_Vendor_FindRequest(req->bRequest);
+	if ((req->bmRequest & VND_REQ_RECIPIENT_MASK) != VND_REQ_RECIPIENT_INTERFACE
+		|| channel >= USB_VENDOR_COUNT
+		|| request == NULL
+		|| (req->bmRequest & VND_REQ_DIR_MASK) != request->direction)
+	{
+		USB_CTL_Stall();
+		return;
+	}
+
+	VendorCtl_t * ctl = &gChannels[channel].ctl;
+	uint8_t * data = (uint8_t *)ctl->data;
+	if (request->direction == VND_REQ_DIR_IN)
+	{
+		bzero(ctl->data, sizeof(ctl->data));
+		request->handler(channel, req->wValue, data);
+		USB_CTL_Send(data, req->wLength < request->size ? req->wLength : request->size);
+	}
+	else if (req->wLength != request->size)
+	{
+		// The data stage must match the request.
+		USB_CTL_Stall();
+	}
+	else if (request->size)
+	{
+		ctl->request = request;
+		ctl->value = req->wValue;
+		gVendor.ctlChannel = channel;
+		USB_CTL_Receive(data, request->size, USB_Vendor_CtlRxReady);
+	}
+	else
+	{
+		request->handler(channel, req->wValue, NULL);
+	}
+}
+
+bool USB_Vendor_IsOpen(uint8_t channel)
+{
+	return gChannels[channel].open;
+}
+
+uint32_t USB_Vendor_ReadReady(uint8_t channel)
+{
+	VendorChannel_t * ch = gChannels + channel;
+	return VND_BFR_WRAP(&ch->rx, ch->rx.head - ch->rx.tail);
+}
+
+uint32_t USB_Vendor_Peek(uint8_t channel, const uint8_t ** data)
+{
+	VendorChannel_t * ch = gChannels + channel;
+	uint32_t tail = ch->rx.tail;
+	uint32_t ready = USB_Vendor_ReadReady(channel);
+
+	// Only the continuous section is exposed. The rest is available after a consume.
+	uint32_t chunk = ch->rx.size - tail;
+	*data = ch->rx.buffer + tail;
+	return ready < chunk ? ready : chunk;
+}
+
+void USB_Vendor_Consume(uint8_t channel, uint32_t count)
+{
+	VendorChannel_t * ch = gChannels + channel;
+
+	// Closing the channel flushes the buffer, so the data being consumed may already be gone.
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	uint32_t ready = USB_Vendor_ReadReady(channel);
+	if (count > ready)
+	{
+		count = ready;
+	}
+	ch->rx.tail = VND_BFR_WRAP(&ch->rx, ch->rx.tail + count);
+	__set_PRIMASK(primask);
+
+	// The OUT endpoint is shared, so it is held while any channel is full.
+	// The endpoint is idle while held, so this cannot race the receive callback.
+	if (gVendor.rxHeld)
+	{
+		USB_Vendor_ReceiveNext();
+	}
+}
+
+uint32_t USB_Vendor_WriteReady(uint8_t channel)
+{
+	VendorChannel_t * ch = gChannels + channel;
+	if (!ch->open)
+	{
+		// Nobody is listening.
+		return 0;
+	}
+	// Minus 1 because head == tail represents the empty condition.
+	return VND_BFR_WRAP(&ch->tx, ch->tx.tail - ch->tx.head - 1);
+}
+
+uint32_t USB_Vendor_Write(uint8_t channel, const uint8_t * data, uint32_t count)
+{
+	VendorChannel_t * ch = gChannels + channel;
+	uint32_t space = USB_Vendor_WriteReady(channel);
+
+	if (count > space)
+	{
+		count = space;
+	}
+	if (count > 0)
+	{
+		Vendor_BufferPut(&ch->tx, data, count);
+
+		// If the endpoint is idle we need to start the transfer.
+		// Otherwise the transmit complete callback will pick up the new data.
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		if (!gVendor.txBusy)
+		{
+			USB_Vendor_TransmitNext();
+		}
+		__set_PRIMASK(primask);
+	}
+	return count;
+}
+
+bool USB_Vendor_PollLineCoding(uint8_t channel, USB_CDCX_LineCoding_t * coding)
+{
+	VendorChannel_t * ch = gChannels + channel;
+	if (!ch->lineCodingChanged)
+	{
+		return false;
+	}
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	ch->lineCodingChanged = false;
+	const uint8_t * lc = ch->lineCoding;
+	coding->baud = lc[0] | (lc[1] << 8) | (lc[2] << 16) | ((uint32_t)lc[3] << 24);
+	coding->stop_bits = lc[4];
+	coding->parity = lc[5];
+	coding->data_bits = lc[6];
+	__set_PRIMASK(primask);
+	return true;
+}
+
+/*
+ * PRIVATE FUNCTIONS
+ */
+
+static const VendorRequest_t * USB_Vendor_FindRequest(uint8_t request)
+{
+	for (uint32_t i = 0; i < LENGTH(cVendor_Requests); i++)
+	{
+		if (cVendor_Requests[i].request == request)
+		{
+			return cVendor_Requests + i;
+		}
+	}
+	return NULL;
+}
+
+static void USB_Vendor_CtlRxReady(void)
+{
+	uint8_t channel = gVendor.ctlChannel;
+	VendorCtl_t * ctl = &gChannels[channel].ctl;
+	const VendorRequest_t * request = ctl->request;
+	if (request)
+	{
+		ctl->request = NULL;
+		request->handler(channel, ctl->value, (uint8_t *)ctl->data);
+	}
+}
+
+static void Vendor_SetLineCoding(uint8_t channel, uint16_t value, uint8_t * data)
+{
+	VendorChannel_t * ch = gChannels + channel;
+	memcpy(ch->lineCoding, data, sizeof(ch->lineCoding));
+	ch->lineCodingChanged = true;
+}
+
+static void Vendor_GetLineCoding(uint8_t channel, uint16_t value, uint8_t * data)
+{
+	VendorChannel_t * ch = gChannels + channel;
+	memcpy(data, ch->lineCoding, sizeof(ch->lineCoding));
+}
+
+static void Vendor_SetChannelOpen(uint8_t channel, uint16_t value, uint8_t * data)
+{
+	VendorChannel_t * ch = gChannels + channel;
+	ch->open = HIBYTE(value) != 0;
+	if (!ch->open)
+	{
+		// Nothing from the old session may leak into the next one.
+		ch->rx.head = ch->rx.tail;
+		ch->tx.tail = ch->tx.head;
+		if (gVendor.rxHeld)
+		{
+			USB_Vendor_ReceiveNext();
+		}
+	}
+}
+
+static void USB_Vendor_Receive(uint32_t count)
+{
+	const uint8_t * packet = gVendor.rx_packet;
+	if (count >= USB_VENDOR_HEADER_SIZE)
+	{
+		uint8_t channel = packet[0];
+		uint32_t size = packet[1];
+
+		// Malformed frames, and frames for closed channels are discarded.
+		if (channel < USB_VENDOR_COUNT && size > 0 && size <= count - USB_VENDOR_HEADER_SIZE && gChannels[channel].open)
+		{
+			// ReceiveNext only arms the endpoint when every channel can take a full payload.
+			Vendor_BufferPut(&gChannels[channel].rx, packet + USB_VENDOR_HEADER_SIZE, size);
+		}
+	}
+
+	USB_Vendor_ReceiveNext();
+}
+
+static void USB_Vendor_ReceiveNext(void)
+{
+	for (uint8_t channel = 0; channel < USB_VENDOR_COUNT; channel++)
+	{
+		VendorChannel_t * ch = gChannels + channel;
+		uint32_t space = VND_BFR_WRAP(&ch->rx, ch->rx.tail - ch->rx.head - 1);
+		if (space < USB_VENDOR_PAYLOAD_MAX)
+		{
+			// Leave the endpoint un-armed, so the host gets NAKs until we catch up.
+			// USB_Vendor_Consume will re-arm it once there is space.
+			gVendor.rxHeld = true;
+			return;
+		}
+	}
+
+	gVendor.rxHeld = false;
+	USB_EP_Read(VND_OUT_EP, gVendor.rx_packet, VND_PACKET_SIZE);
+}
+
+static void USB_Vendor_TransmitNext(void)
+{
+	// Channels are serviced round robin, so one busy stream cannot starve the others.
+	for (uint8_t i = 0; i < USB_VENDOR_COUNT; i++)
+	{
+		uint8_t channel = gVendor.txNext;
+		gVendor.txNext = (channel + 1) % USB_VENDOR_COUNT;
+
+		VendorChannel_t * ch = gChannels + channel;
+		uint32_t count = VND_BFR_WRAP(&ch->tx, ch->tx.head - ch->tx.tail);
+		if (count > 0)
+		{
+			if (count > USB_VENDOR_PAYLOAD_MAX)
+			{
+				count = USB_VENDOR_PAYLOAD_MAX;
+			}
+			uint8_t * packet = gVendor.tx_packet;
+			packet[0] = channel;
+			packet[1] = count;
+			Vendor_BufferGet(&ch->tx, packet + USB_VENDOR_HEADER_SIZE, count);
+
+			gVendor.txBusy = true;
+			USB_EP_Write(VND_IN_EP, packet, count + USB_VENDOR_HEADER_SIZE);
+			return;
+		}
+	}
+	gVendor.txBusy = false;
+}
+
+static void USB_Vendor_TransmitDone(uint32_t count)
+{
+	if (count == VND_PACKET_SIZE)
+	{
+		// The frame was copied out on transmit, so the buffers can be checked directly.
+		bool pending = false;
+		for (uint8_t channel = 0; channel < USB_VENDOR_COUNT; channel++)
+		{
+			VendorChannel_t * ch = gChannels + channel;
+			pending |= ch->tx.head != ch->tx.tail;
+		}
+		if (!pending)
+		{
+			// Write a ZLP to complete the tx.
+			USB_EP_WriteZLP(VND_IN_EP);
+			return;
+		}
+	}
+	USB_Vendor_TransmitNext();
+}
+
+static void Vendor_BufferPut(VendorBuffer_t * bfr, const uint8_t * data, uint32_t count)
+{
+	uint32_t head = bfr->head;
+	uint32_t newhead = VND_BFR_WRAP(bfr, head + count);
+	if (newhead > head)
+	{
+		// We can write continuously into the buffer
+		memcpy(bfr->buffer + head, data, count);
+	}
+	else
+	{
+		// We write to end of buffer, then write from the start
+		uint32_t chunk = bfr->size - head;
+		memcpy(bfr->buffer + head, data, chunk);
+		memcpy(bfr->buffer, data + chunk, count - chunk);
+	}
+	bfr->head = newhead;
+}
+
+static void Vendor_BufferGet(VendorBuffer_t * bfr, uint8_t * data, uint32_t count)
+{
+	uint32_t tail = bfr->tail;
+	if (tail + count <= bfr->size)
+	{
+		// We can read continuously from the buffer
+		memcpy(data, bfr->buffer + tail, count);
+	}
+	else
+	{
+		// We read to end of buffer, then read from the start
+		uint32_t chunk = bfr->size - tail;
+		memcpy(data, bfr->buffer + tail, chunk);
+		memcpy(data + chunk, bfr->buffer, count - chunk);
+	}
+	bfr->tail = VND_BFR_WRAP(bfr, tail + count);
+}
+
+#endif //USB_VENDOR_ENABLE
+
@@ -0,0 +1,76 @@
+#ifndef USB_VENDOR_H
+#define USB_VENDOR_H
+
+#include "STM32X.h"
+#include "usb/USB_Defs.h"
+#include "USB_CDCX.h"
+
+/*
+ * PUBLIC DEFINITIONS
+ */
+
+// The vendor channel table. Each CHANNEL(n, rx, tx) entry is a byte stream, multiplexed
+// over a single pair of bulk endpoints. Entries must be numbered from 0.
+// The rx and tx buffer sizes must be powers of two.
+#ifndef USB_VENDOR_CHANNELS
+#define USB_VENDOR_CHANNELS(CHANNEL)		CHANNEL(0, 512, 512)
+#endif
+
+#define USB_VENDOR_CHANNEL_COUNT(n, rx, tx)	+ 1
+#define USB_VENDOR_COUNT					(0 USB_VENDOR_CHANNELS(USB_VENDOR_CHANNEL_COUNT))
+
+// A single interface, with a bulk IN and OUT endpoint.
+#define USB_VENDOR_INTERFACES				1
+#define USB_VENDOR_ENDPOINTS				1
+#define USB_VENDOR_PMA_SIZE					(2 * USB_PACKET_SIZE)
+
+// Every bulk packet carries one frame: a channel byte, a length byte, then the payload.
+#define USB_VENDOR_HEADER_SIZE				2
+#define USB_VENDOR_PAYLOAD_MAX				(USB_PACKET_SIZE - USB_VENDOR_HEADER_SIZE)
+
+// Vendor requests, sent to the interface. wValue holds the channel. Anything else is stalled.
+// There are no MS OS 2.0 descriptors: the USB driver answers GET_DESCRIPTOR itself, and cannot serve a BOS.
+#define USB_VENDOR_SET_LINE_CODING			0x01	// 7 bytes, as per CDC
+#define USB_VENDOR_GET_LINE_CODING			0x02
+#define USB_VENDOR_SET_CHANNEL_OPEN			0x03	// wValue high byte: 1 to open, 0 to close
+
+#define USB_VENDOR_DESC_SIZE				23
+
+#define USB_VENDOR_DESC(_interface, _endpoint) \
+	USB_DESCR_BLOCK_INTERFACE(_interface, 0x02, 0xFF, 0x00, 0x00), \
+	USB_DESCR_BLOCK_ENDPOINT((_endpoint), 0x02, USB_PACKET_SIZE, 0x00), \
+	USB_DESCR_BLOCK_ENDPOINT((_endpoint) | 0x80, 0x02, USB_PACKET_SIZE, 0x00)
+
+/*
+ * PUBLIC TYPES
+ */
+
+/*
+ * PUBLIC FUNCTIONS
+ */
+
+// Callbacks for USB_CTL.
+// These should be referenced in USB_Class.h
+void USB_Vendor_Init(uint8_t config);
+void USB_Vendor_Deinit(void);
+void USB_Vendor_Setup(USB_SetupRequest_t * req);
+
+// A channel is opened by the host with USB_VENDOR_SET_CHANNEL_OPEN.
+bool USB_Vendor_IsOpen(uint8_t channel);
+
+uint32_t USB_Vendor_ReadReady(uint8_t channel);
+uint32_t USB_Vendor_Peek(uint8_t channel, const uint8_t ** data);
+void USB_Vendor_Consume(uint8_t channel, uint32_t count);
+
+// Writes are buffered and do not block. These return the number of bytes accepted.
+uint32_t USB_Vendor_WriteReady(uint8_t channel);
+uint32_t USB_Vendor_Write(uint8_t channel, const uint8_t * data, uint32_t count);
+
+// Returns true once for each line coding set by the host.
+bool USB_Vendor_PollLineCoding(uint8_t channel, USB_CDCX_LineCoding_t * coding);
+
+/*
+ * EXTERN DECLARATIONS
+ */
+
+#endif // USB_VENDOR_H
@@ -0,0 +1,228 @@
+
+#include "Updater.h"
+
+/*
+ * PRIVATE DEFINITIONS
+ */
+
+#define UPDATER_MEM_MODE_SRAM		(SYSCFG_CFGR1_MEM_MODE_0 | SYSCFG_CFGR1_MEM_MODE_1)
+#define UPDATER_FLASH_ERRORS		(FLASH_SR_PGERR | FLASH_SR_WRPRTERR)
+#define UPDATER_CORE_VECTORS		16
+
+/*
+ * PRIVATE TYPES
+ */
+
+/*
+ * PRIVATE PROTOTYPES
+ */
+
+static bool Updater_ErasePage(uint32_t address);
+static bool Updater_Program(uint32_t address, const uint8_t * data, uint32_t size);
+static bool Updater_WaitIdle(void);
+static uint32_t Updater_CRC(uint32_t address, uint32_t size);
+
+/*
+ * PRIVATE VARIABLES
+ */
+
+// Placed at the base of SRAM by the linker.
+__attribute__((section(".ram_vector")))
+static volatile uint32_t gVectors[UPDATER_VECTOR_COUNT];
+
+extern const uint32_t g_pfnVectors[];
+
+static struct {
+	uint32_t size;
+	Updater_Status_t status;
+} gUpdater;
+
+/*
+ * PUBLIC FUNCTIONS
+ */
+
+void Updater_RemapVectors(void)
+{
+	// The M0 has no VTOR. The boot vectors stay at address 0 until SRAM is mapped over them.
+	for (uint32_t i = 0; i < UPDATER_VECTOR_COUNT; i++)
+	{
+		gVectors[i] = g_pfnVectors[i];
+	}
+	RCC->APB2ENR |= RCC_APB2ENR_SYSCFGEN;
+	SYSCFG->CFGR1 = (SYSCFG->CFGR1 & ~SYSCFG_CFGR1_MEM_MODE) | UPDATER_MEM_MODE_SRAM;
+}
+
+VoidFunction_t Updater_SetHandler(IRQn_Type irq, VoidFunction_t handler)
+{
+	// Device interrupts follow the core exceptions.
+	volatile uint32_t * vector = gVectors + UPDATER_CORE_VECTORS + irq;
+	VoidFunction_t previous = (VoidFunction_t)*vector;
+	*vector = (uint32_t)handler;
+	return previous;
+}
+
+void Updater_Begin(void)
+{
+	gUpdater.size = 0;
+	gUpdater.status = Updater_Status_Ok;
+
+	// Erasing the header is enough to discard the last image.
+	FLASH->KEYR = FLASH_KEY1;
+	FLASH->KEYR = FLASH_KEY2;
+	if (!Updater_ErasePage(UPDATER_HEADER_BASE))
+	{
+		gUpdater.status = Updater_Status_Erase;
+	}
+	FLASH->CR |= FLASH_CR_LOCK;
+}
+
+Updater_Status_t Updater_Write(uint32_t offset, const uint8_t * data, uint32_t size)
+{
+	if (gUpdater.status != Updater_Status_Ok)
+	{
+		return gUpdater.status;
+	}
+	// A short write must be the last one, so the next write will not follow on.
+	if (offset != gUpdater.size || (offset % UPDATER_PAGE_SIZE) + size > UPDATER_PAGE_SIZE
+			|| offset + size > UPDATER_IMAGE_SIZE)
+	{
+		return Updater_Status_Address;
+	}
+
+	uint32_t address = UPDATER_IMAGE_BASE + offset;
+	FLASH->KEYR = FLASH_KEY1;
+	FLASH->KEYR = FLASH_KEY2;
+	Updater_Status_t status = Updater_Status_Ok;
+	// Each page is erased when the write at its start arrives.
+	if ((offset % UPDATER_PAGE_SIZE) == 0 && !Updater_ErasePage(address))
+	{
+		status = Updater_Status_Erase;
+	}
+	else if (!Updater_Program(address, data, size))
+	{
+		status = Updater_Status_Program;
+	}
+	FLASH->CR |= FLASH_CR_LOCK;
+
+	if (status == Updater_Status_Ok && memcmp((const void *)address, data, size) != 0)
+	{
+		status = Updater_Status_Verify;
+	}
+
+	gUpdater.status = status;
+	if (status == Updater_Status_Ok)
+	{
+		gUpdater.size += size;
+	}
+	return status;
+}
+
+Updater_Status_t Updater_Finish(void)
+{
+	if (gUpdater.status != Updater_Status_Ok)
+	{
+		return gUpdater.status;
+	}
+	if (gUpdater.size == 0)
+	{
+		return Updater_Status_NotDone;
+	}
+
+	// The image must be linked for the application region, or the boot could not start it.
+	const uint32_t * vectors = (const uint32_t *)UPDATER_IMAGE_BASE;
+	uint32_t sp = vectors[0];
+	uint32_t pc = vectors[1] & ~1;
+	if (sp <= UPDATER_RAM_BASE || sp > UPDATER_RAM_END
+			|| pc < UPDATER_APP_BASE || pc >= UPDATER_APP_BASE + gUpdater.size)
+	{
+		return Updater_Status_Firmware;
+	}
+
+	// Any padding up to the next word is still erased, and is installed with the image.
+	uint32_t size = (gUpdater.size + 3) & ~3;
+	Updater_Header_t header = {
+		.magic = UPDATER_MAGIC,
+		.size = size,
+		.crc = Updater_CRC(UPDATER_IMAGE_BASE, size),
+		.check = ~UPDATER_MAGIC,
+	};
+
+	FLASH->KEYR = FLASH_KEY1;
+	FLASH->KEYR = FLASH_KEY2;
+	bool success = Updater_Program(UPDATER_HEADER_BASE, (const uint8_t *)&header, sizeof(header));
+	FLASH->CR |= FLASH_CR_LOCK;
+
+	if (!success)
+	{
+		return Updater_Status_Program;
+	}
+	if (memcmp((const void *)UPDATER_HEADER_BASE, &header, sizeof(header)) != 0)
+	{
+		return Updater_Status_Verify;
+	}
+	return Updater_Status_Ok;
+}
+
+Updater_Status_t Updater_GetInstallStatus(void)
+{
+	// The results are erased with the header page, so they only survive while the image is still staged.
+	const volatile uint16_t * results = (const volatile uint16_t *)UPDATER_RESULTS_BASE;
+	Updater_Status_t status = Updater_Status_Ok;
+	for (uint32_t i = 0; i < UPDATER_INSTALL_ATTEMPTS; i++)
+	{
+		if (results[i] != 0xFFFF)
+		{
+			status = (Updater_Status_t)results[i];
+		}
+	}
+	return status;
+}
+
+/*
+ * PRIVATE FUNCTIONS
+ */
+
+static bool Updater_ErasePage(uint32_t address)
+{
+	FLASH->CR |= FLASH_CR_PER;
+	FLASH->AR = address;
+	FLASH->CR |= FLASH_CR_STRT;
+	bool success = Updater_WaitIdle();
+	FLASH->CR &= ~FLASH_CR_PER;
+	return success;
+}
+
+static bool Updater_Program(uint32_t address, const uint8_t * data, uint32_t size)
+{
+	// Flash is programmed by halfword. An odd tail is padded with the erased value.
+	bool success = true;
+	FLASH->CR |= FLASH_CR_PG;
+	for (uint32_t i = 0; i < size && success; i += 2)
+	{
+		uint16_t half = data[i] | ((i + 1 < size ? data[i + 1] : 0xFF) << 8);
+		*(volatile uint16_t *)(address + i) = half;
+		success = Updater_WaitIdle();
+	}
+	FLASH->CR &= ~FLASH_CR_PG;
+	return success;
+}
+
+static bool Updater_WaitIdle(void)
+{
+	while (FLASH->SR & FLASH_SR_BSY);
+	uint32_t sr = FLASH->SR;
+	FLASH->SR = sr & (UPDATER_FLASH_ERRORS | FLASH_SR_EOP);
+	return !(sr & UPDATER_FLASH_ERRORS);
+}
+
+static uint32_t Updater_CRC(uint32_t address, uint32_t size)
+{
+	RCC->AHBENR |= RCC_AHBENR_CRCEN;
+	CRC->CR = CRC_CR_RESET;
+	const uint32_t * words = (const uint32_t *)address;
+	for (uint32_t i = 0; i < size / 4; i++)
+	{
+		CRC->DR = words[i];
+	}
+	return CRC->DR;
+}
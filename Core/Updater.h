@@ -0,0 +1,90 @@
+#ifndef UPDATER_H
+#define UPDATER_H
+
+#include "STM32X.h"
+
+/*
+ * PUBLIC DEFINITIONS
+ */
+
+// Flash layout. This must match the MEMORY regions in STM32F072CBUX_FLASH.ld
+//  BOOT	The resident boot, which installs staged images. This is never updated in the field.
+//  APP		The application, including its own vector table.
+//  STAGE	A header page, followed by the image being downloaded.
+#define UPDATER_PAGE_SIZE			2048
+#define UPDATER_BOOT_BASE			0x08000000
+#define UPDATER_BOOT_SIZE			(2 * UPDATER_PAGE_SIZE)
+#define UPDATER_APP_BASE			(UPDATER_BOOT_BASE + UPDATER_BOOT_SIZE)
+#define UPDATER_APP_SIZE			(30 * UPDATER_PAGE_SIZE)
+#define UPDATER_HEADER_BASE			(UPDATER_APP_BASE + UPDATER_APP_SIZE)
+#define UPDATER_IMAGE_BASE			(UPDATER_HEADER_BASE + UPDATER_PAGE_SIZE)
+#define UPDATER_IMAGE_SIZE			UPDATER_APP_SIZE
+
+#define UPDATER_FLASH_END			(UPDATER_BOOT_BASE + (128 * 1024))
+
+// The application vector table is copied here, and SRAM is remapped to address 0.
+// This must match the RAM_VECTOR region in the linker script.
+#define UPDATER_VECTOR_COUNT		48
+#define UPDATER_RAM_BASE			0x20000000
+#define UPDATER_RAM_END				(UPDATER_RAM_BASE + (16 * 1024))
+
+#define UPDATER_MAGIC				0x57434654U
+
+// The boot clears one erased halfword after the header before each install attempt, so the count survives the reset.
+// A failed attempt writes the stage that failed into the matching result halfword.
+// Once they are all used it gives up, and starts the resident application if it is still valid.
+// Erasing the header page resets the count.
+#define UPDATER_INSTALL_ATTEMPTS	3
+#define UPDATER_ATTEMPTS_BASE		(UPDATER_HEADER_BASE + sizeof(Updater_Header_t))
+#define UPDATER_RESULTS_BASE		(UPDATER_ATTEMPTS_BASE + (UPDATER_INSTALL_ATTEMPTS * 2))
+
+_Static_assert(UPDATER_IMAGE_BASE + UPDATER_IMAGE_SIZE <= UPDATER_FLASH_END, "Flash layout does not fit");
+
+/*
+ * PUBLIC TYPES
+ */
+
+// These values match the DFU bStatus encoding.
+typedef enum {
+	Updater_Status_Ok			= 0x00,
+	Updater_Status_Erase		= 0x04,
+	Updater_Status_Program		= 0x06,
+	Updater_Status_Verify		= 0x07,
+	Updater_Status_Address		= 0x08,
+	Updater_Status_NotDone		= 0x09,
+	Updater_Status_Firmware		= 0x0A,
+} Updater_Status_t;
+
+// Written to the header page once a complete image is staged.
+// The CRC is the STM32 hardware CRC over the image words.
+typedef struct {
+	uint32_t magic;
+	uint32_t size;
+	uint32_t crc;
+	uint32_t check;			// The inverse of the magic, so a half written header is not valid.
+} Updater_Header_t;
+
+/*
+ * PUBLIC FUNCTIONS
+ */
+
+// Moves the application vector table into SRAM. This must be called before interrupts are enabled.
+void Updater_RemapVectors(void);
+// Replaces a handler in the remapped vector table. The previous handler is returned, so it can be restored.
+VoidFunction_t Updater_SetHandler(IRQn_Type irq, VoidFunction_t handler);
+
+// Discards any staged image, and starts a new one.
+void Updater_Begin(void);
+// Images are written in order, and no write may cross a page. Only the last may be short.
+// Each page is erased by the write at its start. Every write is programmed, and read back.
+Updater_Status_t Updater_Write(uint32_t offset, const uint8_t * data, uint32_t size);
+// Checks the image, and writes the header. The boot installs it on the next reset.
+Updater_Status_t Updater_Finish(void);
+// Returns the stage at which the boot last failed to install the staged image, or Ok.
+Updater_Status_t Updater_GetInstallStatus(void);
+
+/*
+ * EXTERN DECLARATIONS
+ */
+
+#endif // UPDATER_H
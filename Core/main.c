@@ -4,36 +4,524 @@
 #include "GPIO.h"
 #include "USB.h"
 #include "USB_CDCX.h"
+#include "USB_Composite.h"
 #include "Console.h"
 #include "LED.h"
 #include "UART.h"
+#include "UARTX.h"
+#include "Updater.h"
 #include "I2C.h"
 #include "M24xx.h"
 
 #include "SCPI.h"
+#include <inttypes.h>
+#include <strings.h>
 
 
 #define DETECT_STRING_MAX		32
 
+// Twelve counters of up to 10 digits, and the separators.
+#define USB_STATS_REPLY_MAX		((12 * 10) + 11)
+
+#define BRIDGE_LATENCY_MAX		255
+// Each candidate rate is probed for this long while searching for the modem.
+#define BRIDGE_AUTOBAUD_WINDOW	100
+#define BRIDGE_AUTOBAUD_TIMEOUT	2000
+#define BRIDGE_AUTOBAUD_MAX		10000
+// Once the rate is found, the bridge opens when the modem has been quiet for this long.
+#define BRIDGE_AUTOBAUD_QUIET	20
+// A SEND_BREAK with this duration holds the break until it is cleared.
+#define BRIDGE_BREAK_HOLD		0xFFFF
+// With flow control, RTS is held once the USB side has less room than this.
+// This must cover the bytes received before the far end stops. An attached link checks it as the port fills.
+// Otherwise it must also cover the main loop latency.
+#define BRIDGE_RTS_HEADROOM		256
+#define BRIDGE_RTS_RESUME		(2 * BRIDGE_RTS_HEADROOM)
+
+#ifdef BRIDGE_RX_DMA
+#define BRIDGE_LINK_RX			UARTX_LinkMode_RxDMA
+#else
+#define BRIDGE_LINK_RX			UARTX_LinkMode_IRQ
+#endif
+#ifdef BRIDGE_TX_DMA
+#define BRIDGE_LINK_TX			UARTX_LinkMode_TxDMA
+#else
+#define BRIDGE_LINK_TX			UARTX_LinkMode_IRQ
+#endif
+#define BRIDGE_LINK_MODE		(BRIDGE_LINK_RX | BRIDGE_LINK_TX)
+
+#ifndef MODEM_DCD_ACTIVE
+#define MODEM_DCD_ACTIVE		GPIO_PIN_SET
+#endif
+
+// USB wakeup is routed through EXTI line 18. This lets it bring us out of STOP mode.
+#define USB_WAKEUP_EXTI			EXTI_IMR_MR18
+
+// Long enough for the host to see the device leave the bus after a DFU detach.
+#define USB_DETACH_MS			20
+
+// RAM use is reported per module after each build by Tools/RAMReport.py, from the linker map.
+// The linker fails the build if the static data, _Min_Heap_Size and _Min_Stack_Size do not fit.
+
+_Static_assert(USB_STATS_REPLY_MAX <= SCPI_REPLY_MAX, "SCPI_REPLY_MAX is too short for USB:STATistics?");
+
+typedef struct {
+	bool enabled;
+	uint8_t mask;
+	uint8_t latency;
+	uint32_t baud;
+	UARTX_Framing_t framing;
+	bool breakActive;		// Set while the host wants a break. Host data is held back.
+	bool breakAsserted;		// Set while the TX pin is held low
+	uint16_t breakDuration;
+	uint32_t breakStart;
+	bool flow;				// RTS/CTS is used whenever the bridge is open
+	bool hostRts;			// The RTS line set by the host on the CDC port
+	bool rtsHeld;
+	bool probing;			// Autobaud is searching for the rate. The bridge is closed meanwhile.
+	uint8_t probeRate;		// Index into cBridge_AutoBaudRates
+	uint32_t probeBaud;		// The rate found, while the rest of the response is discarded
+	uint32_t probeStart;	// When the search started, or the rate was found
+	uint32_t probeWindow;	// When the current rate was probed, or data was last discarded
+	uint32_t probeTimeout;
+	uint32_t probeResult;	// The last rate found, or zero
+	UARTX_Framing_t probeFraming;
+} Bridge_t;
+
+// The UART pins of a bridge, for the line conditions that the USART cannot generate itself.
+// The flow control pins are left clear if they are not wired.
+typedef struct {
+	GPIO_Pin_t tx;
+	GPIO_Pin_t rx;
+	GPIO_Pin_t cts;
+	GPIO_Pin_t rts;
+	uint32_t af;
+} BridgeLine_t;
+
+// The USB side of a bridge. This is either a CDC port or a vendor channel.
+typedef struct {
+	uint32_t (*peek)(uint8_t index, const uint8_t ** data);
+	void (*consume)(uint8_t index, uint32_t count);
+	uint32_t (*writeReady)(uint8_t index);
+	uint32_t (*write)(uint8_t index, const uint8_t * data, uint32_t count);
+	bool (*pollLineCoding)(uint8_t index, USB_CDCX_LineCoding_t * coding);
+} BridgeStream_t;
+
+static const BridgeStream_t cBridge_CDC = {
+	.peek = USB_CDCX_Peek,
+	.consume = USB_CDCX_Consume,
+	.writeReady = USB_CDCX_WriteReady,
+	.write = USB_CDCX_Write,
+	.pollLineCoding = USB_CDCX_PollLineCoding,
+};
+
+#ifdef USB_VENDOR_ENABLE
+static const BridgeStream_t cBridge_Vendor = {
+	.peek = USB_Vendor_Peek,
+	.consume = USB_Vendor_Consume,
+	.writeReady = USB_Vendor_WriteReady,
+	.write = USB_Vendor_Write,
+	.pollLineCoding = USB_Vendor_PollLineCoding,
+};
+#endif
+
+static const BridgeLine_t cBridge_ModemLine = {
+	.tx = MODEM_UART_TX,
+	.rx = MODEM_UART_RX,
+#ifdef MODEM_UART_RTS
+	.cts = MODEM_UART_CTS,
+	.rts = MODEM_UART_RTS,
+#endif
+	.af = MODEM_UART_AF,
+};
+
+static const BridgeLine_t cBridge_AuxLine = {
+	.tx = AUX_UART_TX,
+	.rx = AUX_UART_RX,
+	.af = AUX_UART_AF,
+};
+
+// The rates probed by autobaud, most likely first. A measured rate is rounded to the nearest of these.
+static const uint32_t cBridge_AutoBaudRates[] = {
+	115200, 921600, 9600, 230400, 460800, 57600, 38400, 19200, 3000000,
+};
+
+// Indexed by the CDC line coding values.
+static const char * const cBridge_ParityNames[] = { "NONE", "ODD", "EVEN" };
+static const char * const cBridge_StopBitsNames[] = { "1", "1.5", "2" };
+
 static struct {
 	bool pwr_en;
 	bool dtr;
 	bool reset;
 	bool wake;
-	bool uart_modem_en;
-	bool uart_aux_en;
+	Bridge_t modem;
+	Bridge_t aux;
 } gIO;
 
 
+static bool Bridge_OwnsFlowPins(const Bridge_t * bridge)
+{
+	// The flow control pins are only taken while the USART is in use.
+	return bridge->flow && (bridge->enabled || bridge->probing);
+}
+
+static void Bridge_SetFlowControl(UART_t * uart, const BridgeLine_t * line, Bridge_t * bridge)
+{
+	UARTX_SetFlowControl(uart, line->cts, line->rts, line->af, bridge->flow);
+	UARTX_SetRTSHeadroom(uart, line->rts, line->af, bridge->flow ? BRIDGE_RTS_HEADROOM : 0);
+	bridge->rtsHeld = false;
+}
+
+static bool Bridge_Open(UART_t * uart, const BridgeLine_t * line, Bridge_t * bridge, uint32_t baud, const UARTX_Framing_t * framing)
+{
+	// The baud range is limited by the USART clock. UARTX_Init rejects rates it cannot generate.
+	// The link is attached again with the new data mask.
+	UARTX_Detach(uart);
+	if (!UARTX_Init(uart, baud, framing))
+	{
+		return false;
+	}
+	bridge->mask = UARTX_DataMask(framing);
+	bridge->baud = baud;
+	bridge->framing = *framing;
+	bridge->enabled = true;
+	bridge->probing = false;
+	if (bridge->flow)
+	{
+		Bridge_SetFlowControl(uart, line, bridge);
+	}
+	return true;
+}
+
+static void Bridge_Close(UART_t * uart, const BridgeLine_t * line, Bridge_t * bridge)
+{
+	// The pins are released with the UART, so any break is dropped too.
+	UARTX_Detach(uart);
+	if (Bridge_OwnsFlowPins(bridge))
+	{
+		UARTX_SetFlowControl(uart, line->cts, line->rts, line->af, false);
+	}
+	UART_Deinit(uart);
+	bridge->enabled = false;
+	bridge->probing = false;
+	bridge->breakActive = false;
+	bridge->breakAsserted = false;
+}
+
+static uint32_t Bridge_WriteLimit(const BridgeStream_t * stream, uint8_t index, uint32_t size)
+{
+	uint32_t ready = stream->writeReady(index);
+	return ready < size ? ready : size;
+}
+
+static void Bridge_Flow(const BridgeStream_t * stream, uint8_t index, UART_t * uart, const BridgeLine_t * line, Bridge_t * bridge)
+{
+	// RTS is held while the USB side is nearly full, and on CDC while the host has cleared its own RTS.
+	// An attached link may already have held it from its receive interrupt. It is released here.
+	bool held = UARTX_PollRTSHold(uart) || bridge->rtsHeld;
+	uint32_t ready = stream->writeReady(index);
+	bool hold = ready < BRIDGE_RTS_HEADROOM
+			|| (held && ready < BRIDGE_RTS_RESUME)
+			|| (stream == &cBridge_CDC && !bridge->hostRts);
+	if (hold != held)
+	{
+		UARTX_HoldRTS(line->rts, line->af, hold);
+	}
+	bridge->rtsHeld = hold;
+}
+
+static void Bridge_Run(const BridgeStream_t * stream, uint8_t index, UART_t * uart, const BridgeLine_t * line, Bridge_t * bridge)
+{
+	// The host can open the bridge by setting the line coding on its stream.
+	USB_CDCX_LineCoding_t coding;
+	if (stream->pollLineCoding(index, &coding))
+	{
+		UARTX_Framing_t framing = {
+			.data_bits = coding.data_bits,
+			.parity = coding.parity,
+			.stop_bits = coding.stop_bits,
+		};
+		// Unsupported settings are ignored. The bridge keeps its current state.
+		Bridge_Open(uart, line, bridge, coding.baud, &framing);
+	}
+
+	if (bridge->enabled && bridge->flow)
+	{
+		Bridge_Flow(stream, index, uart, line, bridge);
+	}
+
+#ifdef BRIDGE_FORWARD_IRQ
+	// The USART interrupt moves the data while a CDC port is bridged.
+	if (stream == &cBridge_CDC && bridge->enabled)
+	{
+		if (!UARTX_IsAttached(uart))
+		{
+			UARTX_Attach(uart, index, bridge->mask, BRIDGE_LINK_MODE);
+			if (bridge->flow)
+			{
+				UARTX_SetRTSHeadroom(uart, line->rts, line->af, BRIDGE_RTS_HEADROOM);
+			}
+		}
+		return;
+	}
+	UARTX_Detach(uart);
+#endif
+
+	const uint8_t * data = NULL;
+	uint32_t read = 0;
+	if (!bridge->breakActive)
+	{
+		read = stream->peek(index, &data);
+	}
+	if (bridge->enabled)
+	{
+		UART_Write(uart, data, read);
+
+		// Leave data in the UART if the USB side cannot take it yet.
+		uint8_t bfr[64];
+		uint32_t written = UART_Read(uart, bfr, Bridge_WriteLimit(stream, index, sizeof(bfr)));
+		if (bridge->mask != 0xFF)
+		{
+			for (uint32_t i = 0; i < written; i++)
+			{
+				bfr[i] &= bridge->mask;
+			}
+		}
+		stream->write(index, bfr, written);
+	}
+	stream->consume(index, read);
+}
+
+static void Bridge_Break(uint8_t port, UART_t * uart, const BridgeLine_t * line, Bridge_t * bridge)
+{
+	uint16_t duration;
+	if (USB_CDCX_PollBreak(port, &duration))
+	{
+		bridge->breakActive = bridge->enabled && duration != 0;
+		bridge->breakDuration = duration;
+	}
+
+	if (bridge->breakAsserted)
+	{
+		uint32_t elapsed = CORE_GetTick() - bridge->breakStart;
+		if (!bridge->breakActive || (bridge->breakDuration != BRIDGE_BREAK_HOLD && elapsed >= bridge->breakDuration))
+		{
+			UARTX_SetBreak(uart, line->tx, line->af, false);
+			bridge->breakActive = false;
+			bridge->breakAsserted = false;
+		}
+	}
+	else if (bridge->breakActive && UARTX_SetBreak(uart, line->tx, line->af, true))
+	{
+		// The duration is timed from when the break reaches the line.
+		bridge->breakAsserted = true;
+		bridge->breakStart = CORE_GetTick();
+	}
+}
+
+static void Bridge_ReportErrors(uint8_t port, UART_t * uart, const BridgeLine_t * line)
+{
+	UARTX_Error_t errors = UARTX_PollErrors(uart, line->rx);
+	USB_CDCX_State_t events = 0;
+	if (errors & UARTX_Error_Break)		{ events |= USB_CDCX_State_Break; }
+	if (errors & UARTX_Error_Framing)	{ events |= USB_CDCX_State_Framing; }
+	if (errors & UARTX_Error_Parity)	{ events |= USB_CDCX_State_Parity; }
+	if (errors & UARTX_Error_Overrun)	{ events |= USB_CDCX_State_Overrun; }
+	USB_CDCX_SignalEvents(port, events);
+}
+
+static uint32_t Bridge_RoundBaud(uint32_t baud)
+{
+	// The measurement is only as fine as the divider, so a standard rate is preferred when it is close.
+	for (uint32_t i = 0; i < LENGTH(cBridge_AutoBaudRates); i++)
+	{
+		uint32_t rate = cBridge_AutoBaudRates[i];
+		uint32_t error = rate > baud ? rate - baud : baud - rate;
+		if (error * 1000 <= rate * UARTX_BAUD_TOLERANCE)
+		{
+			return rate;
+		}
+	}
+	return baud;
+}
+
+static void Bridge_Probe(UART_t * uart, const BridgeLine_t * line, Bridge_t * bridge)
+{
+	// An AT at the right rate gets an echo or a response, which starts with 'A' or CR.
+	// Anything the modem sends by itself is also measured, whatever rate is being probed.
+	static const uint8_t cProbe[] = "AT\r";
+	UARTX_StartAutoBaud(uart, cBridge_AutoBaudRates[bridge->probeRate]);
+	if (bridge->flow)
+	{
+		// RTS stays with the USART, so the modem is free to answer.
+		UARTX_SetFlowControl(uart, line->cts, line->rts, line->af, true);
+	}
+	UART_Write(uart, cProbe, sizeof(cProbe) - 1);
+	bridge->probeWindow = CORE_GetTick();
+}
+
+static void Bridge_AutoBaud(UART_t * uart, const BridgeLine_t * line, Bridge_t * bridge)
+{
+	uint32_t now = CORE_GetTick();
+	if (!bridge->probeBaud)
+	{
+		uint32_t baud = UARTX_PollAutoBaud(uart);
+		if (baud)
+		{
+			bridge->probeBaud = Bridge_RoundBaud(baud);
+			bridge->probeStart = now;
+			bridge->probeWindow = now;
+		}
+		else if (now - bridge->probeStart < bridge->probeTimeout)
+		{
+			if (now - bridge->probeWindow >= BRIDGE_AUTOBAUD_WINDOW)
+			{
+				bridge->probeRate = (bridge->probeRate + 1) % LENGTH(cBridge_AutoBaudRates);
+				Bridge_Probe(uart, line, bridge);
+			}
+			return;
+		}
+		else
+		{
+			Bridge_Close(uart, line, bridge);
+			bridge->probeResult = 0;
+			return;
+		}
+	}
+
+	// The rest of the echo or response to the probe is discarded, so it is not forwarded to the host.
+	// A modem that keeps talking only delays the bridge by one probe window.
+	uint8_t bfr[64];
+	if (UART_Read(uart, bfr, sizeof(bfr)))
+	{
+		bridge->probeWindow = now;
+	}
+	if (now - bridge->probeWindow < BRIDGE_AUTOBAUD_QUIET && now - bridge->probeStart < BRIDGE_AUTOBAUD_WINDOW)
+	{
+		return;
+	}
+	UARTX_Framing_t framing = bridge->probeFraming;
+	if (Bridge_Open(uart, line, bridge, bridge->probeBaud, &framing))
+	{
+		bridge->probeResult = bridge->probeBaud;
+		return;
+	}
+	Bridge_Close(uart, line, bridge);
+	bridge->probeResult = 0;
+}
+
+static void Bridge_Service(uint8_t port, uint8_t channel, UART_t * uart, const BridgeLine_t * line, Bridge_t * bridge)
+{
+	// Host data is left queued until autobaud opens the bridge.
+	if (bridge->probing)
+	{
+		Bridge_AutoBaud(uart, line, bridge);
+		return;
+	}
+#ifdef USB_VENDOR_ENABLE
+	// The vendor channel takes over the bridge while the host has it open.
+	if (USB_Vendor_IsOpen(channel))
+	{
+		Bridge_Run(&cBridge_Vendor, channel, uart, line, bridge);
+		return;
+	}
+#endif
+	// Line conditions are only carried over CDC.
+	Bridge_Break(port, uart, line, bridge);
+	if (bridge->enabled)
+	{
+		Bridge_ReportErrors(port, uart, line);
+	}
+	Bridge_Run(&cBridge_CDC, port, uart, line, bridge);
+}
+
+
+static void Modem_UpdateSerialState(void)
+{
+	// Report the modem line state on its CDC port.
+	// There is no DSR line, so the modem power is used instead.
+	USB_CDCX_State_t state = 0;
+	if (GPIO_Read(MODEM_DCD) == MODEM_DCD_ACTIVE)
+	{
+		state |= USB_CDCX_State_DCD;
+	}
+	if (gIO.pwr_en)
+	{
+		state |= USB_CDCX_State_DSR;
+	}
+	USB_CDCX_SetSerialState(MODEM_CDC_INDEX, state);
+}
+
+static void Power_Suspend(void)
+{
+	// The UARTs are stopped, but the bridge state is kept so they can be restored on resume.
+	LED_Write(LED_Color_None);
+	// Interrupt links are attached again by the bridge once we resume.
+	UARTX_Detach(MODEM_UART);
+	UARTX_Detach(AUX_UART);
+	if (gIO.modem.enabled) { UART_Deinit(MODEM_UART); }
+	if (gIO.aux.enabled) { UART_Deinit(AUX_UART); }
+#ifdef MODEM_SUSPEND_RELEASE_POWER
+	GPIO_Write(MODEM_PWR_EN, GPIO_PIN_RESET);
+#endif
+
+	EXTI->IMR |= USB_WAKEUP_EXTI;
+	while (true)
+	{
+		// The DCD change interrupt will also bring us out of STOP.
+		GPIO_PinState dcd = GPIO_Read(MODEM_DCD);
+		// Interrupts are masked from the check until STOP, so a resume in between cannot be missed.
+		// A pending interrupt still ends the WFI, and is taken once unmasked.
+		// The USB clock must keep running while we signal resume.
+		__disable_irq();
+		bool suspended = USB_Composite_IsSuspended();
+		if (suspended && !USB_Composite_IsResuming())
+		{
+			CORE_Stop();
+		}
+		__enable_irq();
+		USB_Composite_Poll();
+		if (!suspended)
+		{
+			break;
+		}
+		if (GPIO_Read(MODEM_DCD) != dcd)
+		{
+			// This is ignored unless the host has enabled remote wakeup.
+			USB_Composite_RemoteWakeup();
+		}
+	}
+	EXTI->IMR &= ~USB_WAKEUP_EXTI;
+
+#ifdef MODEM_SUSPEND_RELEASE_POWER
+	GPIO_Write(MODEM_PWR_EN, gIO.pwr_en);
+#endif
+	if (gIO.modem.enabled)
+	{
+		UARTX_Init(MODEM_UART, gIO.modem.baud, &gIO.modem.framing);
+		if (gIO.modem.flow) { Bridge_SetFlowControl(MODEM_UART, &cBridge_ModemLine, &gIO.modem); }
+	}
+	if (gIO.aux.enabled) { UARTX_Init(AUX_UART, gIO.aux.baud, &gIO.aux.framing); }
+}
+
 bool CMD_RST(SCPI_t * scpi, SCPI_Arg_t * args)
 {
+	// This also stops autobaud, and releases the flow control pins if the bridge took them.
+	Bridge_Close(MODEM_UART, &cBridge_ModemLine, &gIO.modem);
+	Bridge_Close(AUX_UART, &cBridge_AuxLine, &gIO.aux);
+	// The host RTS belongs to the CDC port, and is only updated when the host changes it.
+	bool hostRts = gIO.modem.hostRts;
 	bzero(&gIO, sizeof(gIO));
+	gIO.modem.hostRts = hostRts;
+	// The CDC ports hold their own copy of the latency.
+	USB_CDCX_SetLatency(MODEM_CDC_INDEX, 0);
+	USB_CDCX_SetLatency(AUX_CDC_INDEX, 0);
 	GPIO_Write(MODEM_PWR_EN, GPIO_PIN_RESET);
 	GPIO_Write(MODEM_RESET, GPIO_PIN_RESET);
 	GPIO_Write(MODEM_WAKE, GPIO_PIN_RESET);
 	GPIO_Write(MODEM_DTR, GPIO_PIN_RESET);
-	UART_Deinit(MODEM_UART);
-	UART_Deinit(AUX_UART);
+	Modem_UpdateSerialState();
 	return true;
 }
 
@@ -59,7 +547,9 @@ bool CMD_PinState(SCPI_t * scpi, SCPI_Arg_t * args, GPIO_Pin_t pin, bool * state
 
 bool CMD_Power(SCPI_t * scpi, SCPI_Arg_t * args)
 {
-	return CMD_PinState(scpi, args, MODEM_PWR_EN, &gIO.pwr_en);
+	bool success = CMD_PinState(scpi, args, MODEM_PWR_EN, &gIO.pwr_en);
+	Modem_UpdateSerialState();
+	return success;
 }
 
 bool CMD_IO_DTR(SCPI_t * scpi, SCPI_Arg_t * args)
@@ -83,12 +573,64 @@ bool CMD_IO_Wake(SCPI_t * scpi, SCPI_Arg_t * args)
 	return CMD_PinState(scpi, args, MODEM_WAKE, &gIO.wake);
 }
 
-bool CMD_UARTX(SCPI_t * scpi, SCPI_Arg_t * args, UART_t * uart, bool * state)
+static bool Bridge_DecodeFraming(SCPI_Arg_t * args, UARTX_Framing_t * framing)
+{
+	// Arguments that are left out are taken from 8N1.
+	*framing = cUARTX_Framing_8N1;
+	if (args[0].present)
+	{
+		uint32_t i = 0;
+		while (i < LENGTH(cBridge_ParityNames) && strcasecmp(args[0].string, cBridge_ParityNames[i]) != 0) { i++; }
+		if (i == LENGTH(cBridge_ParityNames))
+		{
+			return false;
+		}
+		framing->parity = i;
+	}
+	if (args[1].present)
+	{
+		// Stop bits are given to one decimal place, for 1.5
+		switch (args[1].number)
+		{
+		case 10:
+			framing->stop_bits = UARTX_StopBits_1;
+			break;
+		case 15:
+			framing->stop_bits = UARTX_StopBits_1_5;
+			break;
+		case 20:
+			framing->stop_bits = UARTX_StopBits_2;
+			break;
+		default:
+			return false;
+		}
+	}
+	if (args[2].present)
+	{
+		// Received data is passed on as bytes, so wider words are not supported.
+		if (args[2].number != 7 && args[2].number != 8)
+		{
+			return false;
+		}
+		framing->data_bits = args[2].number;
+	}
+	return true;
+}
+
+bool CMD_UARTX(SCPI_t * scpi, SCPI_Arg_t * args, UART_t * uart, const BridgeLine_t * line, Bridge_t * bridge)
 {
 	if (!args)
 	{
 		// Handle query
-		SCPI_Reply_Bool(scpi, *state);
+		if (!bridge->enabled)
+		{
+			SCPI_Reply_Bool(scpi, false);
+			return true;
+		}
+		SCPI_Reply_Printf(scpi, "ON,%" PRIu32 ",%s,%s,%d", bridge->baud,
+				cBridge_ParityNames[bridge->framing.parity],
+				cBridge_StopBitsNames[bridge->framing.stop_bits],
+				bridge->framing.data_bits);
 		return true;
 	}
 
@@ -96,36 +638,185 @@ bool CMD_UARTX(SCPI_t * scpi, SCPI_Arg_t * args, UART_t * uart, bool * state)
 
 	if (enable)
 	{
-		if (!args[1].present)
+		UARTX_Framing_t framing;
+		if (!args[1].present || !Bridge_DecodeFraming(args + 2, &framing))
 		{
 			return false;
 		}
+		return Bridge_Open(uart, line, bridge, args[1].number, &framing);
+	}
+	else
+	{
+		Bridge_Close(uart, line, bridge);
+	}
+	return true;
+}
 
-		uint32_t baud = args[1].number;
-		if (baud < 1200 || baud > 230400)
-		{
-			return false;
-		}
+bool CMD_UARTX_AutoBaud(SCPI_t * scpi, SCPI_Arg_t * args, UART_t * uart, const BridgeLine_t * line, Bridge_t * bridge)
+{
+	if (!args)
+	{
+		// The command only starts the search, so the result is read back with the query.
+		// This is the rate found by the last search, zero if it failed, or -1 while it is still running.
+		SCPI_Reply_Int(scpi, bridge->probing ? -1 : (int32_t)bridge->probeResult);
+		return true;
+	}
 
-		UART_Init(uart, baud, UART_Mode_Default);
-		*state = true;
+	int32_t timeout = BRIDGE_AUTOBAUD_TIMEOUT;
+	if (args[0].present)
+	{
+		timeout = args[0].number;
 	}
-	else
+	if (timeout <= 0 || timeout > BRIDGE_AUTOBAUD_MAX)
+	{
+		return false;
+	}
+
+	// The search runs from the main loop, and the bridge opens at the rate found.
+	// The bridge is closed while probing, so nothing is forwarded at the wrong rate.
+	// An open bridge keeps its framing. Otherwise it opens as 8N1.
+	// The flow control pins are kept, rather than released with the bridge.
+	if (!bridge->probing)
+	{
+		bridge->probeFraming = bridge->enabled ? bridge->framing : cUARTX_Framing_8N1;
+	}
+	UARTX_Detach(uart);
+	bridge->enabled = false;
+	bridge->breakActive = false;
+	bridge->breakAsserted = false;
+	bridge->rtsHeld = false;
+	bridge->probing = true;
+	bridge->probeRate = 0;
+	bridge->probeBaud = 0;
+	bridge->probeStart = CORE_GetTick();
+	bridge->probeTimeout = timeout;
+	bridge->probeResult = 0;
+	Bridge_Probe(uart, line, bridge);
+	return true;
+}
+
+bool CMD_UARTX_Latency(SCPI_t * scpi, SCPI_Arg_t * args, uint8_t port, Bridge_t * bridge)
+{
+	if (!args)
+	{
+		SCPI_Reply_Int(scpi, bridge->latency);
+		return true;
+	}
+
+	int32_t latency = args[0].number;
+	if (latency < 0 || latency > BRIDGE_LATENCY_MAX)
 	{
-		UART_Deinit(uart);
-		*state = false;
+		return false;
 	}
+	bridge->latency = latency;
+	USB_CDCX_SetLatency(port, latency);
+	return true;
+}
+
+bool CMD_UARTX_Flow(SCPI_t * scpi, SCPI_Arg_t * args, const BridgeLine_t * line, Bridge_t * bridge)
+{
+	if (!args)
+	{
+		SCPI_Reply_Bool(scpi, bridge->flow);
+		return true;
+	}
+
+	bool enable = args[0].boolean;
+	// This is an error unless the board defines the flow control pins.
+	// The USART must be disabled to change it, so it is only accepted while the bridge is closed,
+	// and is applied when the bridge next opens.
+	if ((enable && !line->rts) || bridge->enabled || bridge->probing)
+	{
+		return false;
+	}
+	bridge->flow = enable;
+	return true;
+}
+
+bool CMD_UARTX_FullPackets(SCPI_t * scpi, SCPI_Arg_t * args, uint8_t port)
+{
+	if (!args)
+	{
+		SCPI_Reply_Bool(scpi, USB_CDCX_GetFullPackets(port));
+		return true;
+	}
+	USB_CDCX_SetFullPackets(port, args[0].boolean);
 	return true;
 }
 
 bool CMD_UART_Modem(SCPI_t * scpi, SCPI_Arg_t * args)
 {
-	return CMD_UARTX(scpi, args, MODEM_UART, &gIO.uart_modem_en);
+	return CMD_UARTX(scpi, args, MODEM_UART, &cBridge_ModemLine, &gIO.modem);
 }
 
 bool CMD_UART_Aux(SCPI_t * scpi, SCPI_Arg_t * args)
 {
-	return CMD_UARTX(scpi, args, AUX_UART, &gIO.uart_aux_en);
+	return CMD_UARTX(scpi, args, AUX_UART, &cBridge_AuxLine, &gIO.aux);
+}
+
+bool CMD_UART_Modem_Latency(SCPI_t * scpi, SCPI_Arg_t * args)
+{
+	return CMD_UARTX_Latency(scpi, args, MODEM_CDC_INDEX, &gIO.modem);
+}
+
+bool CMD_UART_Aux_Latency(SCPI_t * scpi, SCPI_Arg_t * args)
+{
+	return CMD_UARTX_Latency(scpi, args, AUX_CDC_INDEX, &gIO.aux);
+}
+
+bool CMD_UART_Modem_FullPackets(SCPI_t * scpi, SCPI_Arg_t * args)
+{
+	return CMD_UARTX_FullPackets(scpi, args, MODEM_CDC_INDEX);
+}
+
+bool CMD_UART_Aux_FullPackets(SCPI_t * scpi, SCPI_Arg_t * args)
+{
+	return CMD_UARTX_FullPackets(scpi, args, AUX_CDC_INDEX);
+}
+
+bool CMD_UART_Modem_AutoBaud(SCPI_t * scpi, SCPI_Arg_t * args)
+{
+	return CMD_UARTX_AutoBaud(scpi, args, MODEM_UART, &cBridge_ModemLine, &gIO.modem);
+}
+
+bool CMD_UART_Modem_Flow(SCPI_t * scpi, SCPI_Arg_t * args)
+{
+	return CMD_UARTX_Flow(scpi, args, &cBridge_ModemLine, &gIO.modem);
+}
+
+bool CMD_USB_Stats(SCPI_t * scpi, SCPI_Arg_t * args)
+{
+	if (!args || args[0].number < 0 || args[0].number >= USB_CDC_COUNT)
+	{
+		return false;
+	}
+
+	USB_CDCX_Stats_t s;
+	USB_CDCX_GetStats(args[0].number, &s);
+	SCPI_Reply_Printf(scpi,
+			"%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32
+			",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32,
+			s.rx_packets, s.rx_bytes, s.rx_direct, s.rx_bounced, s.rx_dropped, s.rx_peak, s.rx_held_ms,
+			s.tx_packets, s.tx_bytes, s.tx_zlps, s.tx_rejected, s.tx_peak);
+	return true;
+}
+
+bool CMD_USB_Stats_Reset(SCPI_t * scpi, SCPI_Arg_t * args)
+{
+	if (!args[0].present)
+	{
+		for (uint8_t port = 0; port < USB_CDC_COUNT; port++)
+		{
+			USB_CDCX_ResetStats(port);
+		}
+		return true;
+	}
+	if (args[0].number < 0 || args[0].number >= USB_CDC_COUNT)
+	{
+		return false;
+	}
+	USB_CDCX_ResetStats(args[0].number);
+	return true;
 }
 
 bool CMD_PROM_Detect(SCPI_t * scpi, SCPI_Arg_t * args)
@@ -184,8 +875,16 @@ const SCPI_Node_t cNodes[] = {
 	{ .pattern = ":DCD?", .func = CMD_IO_DCD },
 	{ .pattern = ":RESet b", .func = CMD_IO_Reset },
 	{ .pattern = ":WAKE b", .func = CMD_IO_Wake },
-	{ .pattern = "UART:MODem b,?n", .func = CMD_UART_Modem },
-	{ .pattern = ":AUX b,?n", .func = CMD_UART_Aux },
+	{ .pattern = "UART:MODem b,?n,?s,?n1,?i", .func = CMD_UART_Modem },
+	{ .pattern = "::LATency i", .func = CMD_UART_Modem_Latency },
+	{ .pattern = "::FULLpacket b", .func = CMD_UART_Modem_FullPackets },
+	{ .pattern = "::FLOW b", .func = CMD_UART_Modem_Flow },
+	{ .pattern = "::AUTObaud ?i", .func = CMD_UART_Modem_AutoBaud },
+	{ .pattern = ":AUX b,?n,?s,?n1,?i", .func = CMD_UART_Aux },
+	{ .pattern = "::LATency i", .func = CMD_UART_Aux_Latency },
+	{ .pattern = "::FULLpacket b", .func = CMD_UART_Aux_FullPackets },
+	{ .pattern = "USB:STATistics? i", .func = CMD_USB_Stats },
+	{ .pattern = "::RESet! ?i", .func = CMD_USB_Stats_Reset },
 	{ .pattern = "PROM?", .func = CMD_PROM_Detect },
 	{ .pattern = ":READ?", .func = CMD_PROM_Read },
 	{ .pattern = ":WRITE! s", .func = CMD_PROM_Write },
@@ -196,6 +895,7 @@ static SCPI_t scpi;
 
 int main(void)
 {
+	Updater_RemapVectors();
 	CORE_Init();
 	USB_Init();
 	Console_Init();
@@ -206,30 +906,55 @@ int main(void)
 	GPIO_EnableOutput(MODEM_WAKE, GPIO_PIN_RESET);
 	GPIO_EnableOutput(MODEM_DTR, GPIO_PIN_RESET);
 	GPIO_EnableInput(MODEM_DCD, GPIO_Pull_None);
+	GPIO_OnChange(MODEM_DCD, GPIO_IT_Both, Modem_UpdateSerialState);
+	Modem_UpdateSerialState();
 
 	SCPI_Init(&scpi, cNodes, LENGTH(cNodes), Console_Write);
 
 	while(1)
 	{
-		uint8_t bfr[64];
-		uint32_t read = Console_Read(bfr, sizeof(bfr));
+		if (USB_DFU_PollDetach())
+		{
+			// Come back as a DFU device. The bridges stay down until the update resets us.
+			USB_Deinit();
+			CORE_Delay(USB_DETACH_MS);
+			USB_DFU_EnterMode();
+			USB_Init();
+		}
+		if (USB_DFU_IsDetached())
+		{
+			USB_DFU_Poll();
+			CORE_Idle();
+			continue;
+		}
+
+		// Received CDC data is handled in place, and released once it is used.
+		const uint8_t * data;
+		uint32_t read = USB_CDCX_Peek(CONSOLE_CDC_INDEX, &data);
 
 		LED_Write(LED_Color_Red);
-		SCPI_Parse(&scpi, bfr, read);
+		SCPI_Parse(&scpi, data, read);
+		USB_CDCX_Consume(CONSOLE_CDC_INDEX, read);
 		LED_Write(LED_Color_Green);
 
-		read = USB_CDCX_Read(1, bfr, sizeof(bfr));
-		if (gIO.uart_modem_en)
+		USB_CDCX_Control_t lines;
+		if (USB_CDCX_PollControlLines(MODEM_CDC_INDEX, &lines))
 		{
-			UART_Write(MODEM_UART, bfr, read);
-			USB_CDCX_Write(1, bfr, UART_Read(MODEM_UART, bfr, sizeof(bfr)));
+			// With flow control, the host RTS also holds the modem RTS.
+			gIO.modem.hostRts = lines & USB_CDCX_Control_RTS;
+#ifdef MODEM_DTR_FOLLOWS_CDC
+			gIO.dtr = lines & USB_CDCX_Control_DTR;
+			GPIO_Write(MODEM_DTR, gIO.dtr);
+#endif
 		}
 
-		read = USB_CDCX_Read(2, bfr, sizeof(bfr));
-		if (gIO.uart_aux_en)
+		Bridge_Service(MODEM_CDC_INDEX, MODEM_VENDOR_CHANNEL, MODEM_UART, &cBridge_ModemLine, &gIO.modem);
+		Bridge_Service(AUX_CDC_INDEX, AUX_VENDOR_CHANNEL, AUX_UART, &cBridge_AuxLine, &gIO.aux);
+
+		USB_Composite_Poll();
+		if (USB_Composite_IsSuspended())
 		{
-			UART_Write(AUX_UART, bfr, read);
-			USB_CDCX_Write(2, bfr, UART_Read(AUX_UART, bfr, sizeof(bfr)));
+			Power_Suspend();
 		}
 
 		CORE_Idle();
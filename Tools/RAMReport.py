@@ -0,0 +1,97 @@
+#!/usr/bin/env python3
+# Prints how the RAM is spent, per module, from the linker map.
+#   RAMReport.py Winglet-Carrier-FW.map
+# The stack and heap are taken from _Min_Stack_Size and _Min_Heap_Size in the map.
+# Exits non-zero if they do not fit alongside the static data.
+
+import re
+import sys
+
+# Output sections placed in RAM. Everything in them is charged to the object that supplied it.
+RAM_SECTIONS = ('.ram_vector', '.data', '.bss')
+RAM_REGIONS = ('RAM_VECTOR', 'RAM')
+
+def module_name(path):
+	# Library members are charged to their library.
+	match = re.match(r'.*?([^/\\]+)\.a\(', path)
+	if match:
+		return match.group(1)
+	name = re.split(r'[/\\]', path)[-1]
+	return name[:-2] if name.endswith('.o') else name
+
+def parse(lines):
+	total = 0
+	symbols = {}
+	modules = {}
+	in_memory_map = False
+	section = None
+	pending = False
+	for line in lines:
+		if line.startswith('Memory Configuration'):
+			continue
+		fields = line.split()
+		if not in_memory_map:
+			if line.startswith('Linker script and memory map'):
+				in_memory_map = True
+			elif len(fields) >= 3 and fields[0] in RAM_REGIONS:
+				total += int(fields[2], 16)
+			continue
+
+		match = re.match(r'\s+0x[0-9a-fA-F]+\s+(_Min_\w+_Size)\s*=\s*(0x[0-9a-fA-F]+|\d+)', line)
+		if match:
+			symbols[match.group(1)] = int(match.group(2), 0)
+			continue
+
+		if line and not line[0].isspace():
+			# A new output section.
+			section = fields[0] if fields[0] in RAM_SECTIONS else None
+			continue
+		if section is None or not fields:
+			continue
+
+		if len(fields) == 1 and (fields[0].startswith('.') or fields[0] == 'COMMON'):
+			# The input section name was too long, and the rest follows on the next line.
+			pending = True
+			continue
+		if pending:
+			pending = False
+			fields = [''] + fields
+
+		if len(fields) >= 4 and fields[1].startswith('0x') and fields[2].startswith('0x'):
+			size = int(fields[2], 16)
+			if size:
+				name = 'fill' if fields[0] == '*fill*' else module_name(' '.join(fields[3:]))
+				modules[name] = modules.get(name, 0) + size
+		elif len(fields) >= 3 and fields[0] == '*fill*':
+			modules['fill'] = modules.get('fill', 0) + int(fields[2], 16)
+
+	return total, symbols, modules
+
+def main(argv):
+	if len(argv) != 2:
+		sys.stderr.write('usage: RAMReport.py <map file>\n')
+		return 2
+	with open(argv[1]) as f:
+		total, symbols, modules = parse(f)
+
+	stack = symbols.get('_Min_Stack_Size')
+	heap = symbols.get('_Min_Heap_Size')
+	if stack is None or heap is None or not total:
+		sys.stderr.write('RAMReport: %s does not define the RAM region, stack and heap\n' % argv[1])
+		return 2
+
+	used = sum(modules.values()) + stack + heap
+	print('RAM usage, from %s' % argv[1])
+	for name, size in sorted(modules.items(), key = lambda m: -m[1]):
+		print('  %-24s %6d' % (name, size))
+	print('  %-24s %6d' % ('heap', heap))
+	print('  %-24s %6d' % ('stack', stack))
+	print('  %-24s %6d of %d' % ('total', used, total))
+	print('  %-24s %6d' % ('free', total - used))
+	if used > total:
+		sys.stderr.write('RAMReport: RAM budget exceeded by %d bytes\n' % (used - total))
+		return 1
+	return 0
+
+if __name__ == '__main__':
+	sys.exit(main(sys.argv))
@@ -0,0 +1,211 @@
+
+#include "USB_Sim.h"
+#include "USB_Composite.h"
+#include "USB_CDCX.h"
+
+#include <stdio.h>
+
+/*
+ * PRIVATE DEFINITIONS
+ */
+
+#define BENCH_FRAMES				1000
+#define BENCH_PORT					MODEM_CDC_INDEX
+
+// Bytes per frame that a UART can drain at 921600 baud
+#define BENCH_UART_RATE				92
+
+#define CDC_SET_CONTROL_LINE_STATE	0x22
+
+/*
+ * PRIVATE TYPES
+ */
+
+typedef struct {
+	const char * name;
+	bool rx;				// Host sends data to the device
+	bool tx;				// Device sends data to the host
+	bool loopback;			// Received data is written back
+	uint32_t drain;			// Bytes per frame the application can take. 0 is unlimited.
+	uint32_t chunk;			// Bytes per frame the application writes. 0 writes whatever fits.
+	bool full;
+	uint8_t latency;
+} Scenario_t;
+
+typedef struct {
+	uint32_t payload;
+	uint32_t errors;
+	USBSim_Stats_t usb;
+	USB_CDCX_Stats_t cdc;
+} Result_t;
+
+/*
+ * PRIVATE PROTOTYPES
+ */
+
+static void Bench_Run(const Scenario_t * scenario, Result_t * result);
+static void Bench_Print(const Scenario_t * scenario, const Result_t * result);
+
+/*
+ * PRIVATE VARIABLES
+ */
+
+static const Scenario_t cScenarios[] = {
+	{ .name = "rx unlimited",		.rx = true },
+	{ .name = "rx 921600 baud",		.rx = true, .drain = BENCH_UART_RATE },
+	{ .name = "tx unlimited",		.tx = true },
+	{ .name = "tx unlimited, full",	.tx = true, .full = true },
+	{ .name = "tx 8B/frame",		.tx = true, .chunk = 8 },
+	{ .name = "tx 8B/frame, lat 4",	.tx = true, .chunk = 8, .latency = 4 },
+	{ .name = "tx 64B/frame",		.tx = true, .chunk = 64 },
+	{ .name = "tx 64B/frame, full",	.tx = true, .chunk = 64, .full = true },
+	{ .name = "loopback",			.rx = true, .tx = true, .loopback = true },
+	{ .name = "loopback, full",		.rx = true, .tx = true, .loopback = true, .full = true },
+};
+
+/*
+ * PUBLIC FUNCTIONS
+ */
+
+int main(void)
+{
+	printf("%-22s %8s %8s %8s %8s %8s %6s %8s %6s %6s\n",
+			"scenario", "kB/s", "out pkt", "in pkt", "naks", "held ms", "zlps", "copy/B", "drops", "errors");
+
+	bool failed = false;
+	for (uint32_t i = 0; i < LENGTH(cScenarios); i++)
+	{
+		Result_t result;
+		Bench_Run(cScenarios + i, &result);
+		Bench_Print(cScenarios + i, &result);
+		failed |= result.errors || result.cdc.rx_dropped;
+	}
+	return failed ? 1 : 0;
+}
+
+/*
+ * PRIVATE FUNCTIONS
+ */
+
+static void Bench_Run(const Scenario_t * scenario, Result_t * result)
+{
+	const uint8_t port = BENCH_PORT;
+	const uint8_t out_ep = USB_CDC_ENDPOINT_BASE + (port * 2);
+	const uint8_t in_ep = out_ep | 0x80;
+
+	bzero(result, sizeof(Result_t));
+
+	USBSim_Connect();
+	USB_CDCX_SetFullPackets(port, scenario->full);
+	USB_CDCX_SetLatency(port, scenario->latency);
+
+	// Open the port, so the device accepts data.
+	USB_SetupRequest_t req = {
+		.bmRequest = 0x21,
+		.bRequest = CDC_SET_CONTROL_LINE_STATE,
+		.wValue = USB_CDCX_Control_DTR | USB_CDCX_Control_RTS,
+		.wIndex = USB_CDC_INTERFACE_BASE + (port * 2),
+	};
+	USBSim_Control(&req, NULL);
+
+	USBSim_ResetStats();
+	USB_CDCX_ResetStats(port);
+
+	// Each stream is an incrementing byte pattern, so the far end can check it.
+	uint8_t host_tx = 0;
+	uint8_t host_rx = 0;
+	uint8_t app_tx = 0;
+	uint8_t app_rx = 0;
+	uint32_t budget = 0;
+
+	for (uint32_t frame = 0; frame < BENCH_FRAMES; frame++)
+	{
+		if (scenario->tx && !scenario->loopback && scenario->chunk)
+		{
+			uint8_t bfr[USB_PACKET_SIZE];
+			uint32_t count = scenario->chunk;
+			for (uint32_t i = 0; i < count; i++) { bfr[i] = app_tx + i; }
+			app_tx += USB_CDCX_Write(port, bfr, count);
+		}
+
+		for (uint32_t slot = 0; slot < USBSIM_SLOTS_PER_FRAME; slot++)
+		{
+			// Loopback shares the bus between the directions.
+			bool do_out = scenario->rx && (!scenario->tx || (slot & 1) == 0);
+			bool do_in = scenario->tx && (!scenario->rx || (slot & 1) == 1);
+
+			if (do_out)
+			{
+				uint8_t packet[USB_PACKET_SIZE];
+				for (uint32_t i = 0; i < sizeof(packet); i++) { packet[i] = host_tx + i; }
+				if (USBSim_Out(out_ep, packet, sizeof(packet)))
+				{
+					host_tx += sizeof(packet);
+				}
+			}
+			if (do_in)
+			{
+				uint8_t packet[USB_PACKET_SIZE];
+				int32_t count = USBSim_In(in_ep, packet);
+				for (int32_t i = 0; i < count; i++)
+				{
+					if (packet[i] != host_rx++) { result->errors++; }
+				}
+				if (count > 0) { result->payload += count; }
+			}
+
+			// The application runs between bus transactions.
+			const uint8_t * data;
+			uint32_t read = USB_CDCX_Peek(port, &data);
+			if (scenario->drain)
+			{
+				budget += scenario->drain;
+				uint32_t limit = budget / USBSIM_SLOTS_PER_FRAME;
+				if (read > limit) { read = limit; }
+				budget -= read * USBSIM_SLOTS_PER_FRAME;
+			}
+			if (scenario->loopback)
+			{
+				read = USB_CDCX_Write(port, data, read);
+			}
+			for (uint32_t i = 0; i < read; i++)
+			{
+				if (data[i] != app_rx++) { result->errors++; }
+			}
+			USB_CDCX_Consume(port, read);
+			if (scenario->rx && !scenario->tx)
+			{
+				result->payload += read;
+			}
+
+			if (scenario->tx && !scenario->loopback && !scenario->chunk)
+			{
+				uint8_t bfr[USB_PACKET_SIZE];
+				uint32_t count = USB_CDCX_WriteReady(port);
+				if (count > sizeof(bfr)) { count = sizeof(bfr); }
+				for (uint32_t i = 0; i < count; i++) { bfr[i] = app_tx + i; }
+				app_tx += USB_CDCX_Write(port, bfr, count);
+			}
+		}
+		USBSim_Frame();
+	}
+
+	USBSim_GetStats(&result->usb);
+	USB_CDCX_GetStats(port, &result->cdc);
+	USBSim_Disconnect();
+}
+
+static void Bench_Print(const Scenario_t * scenario, const Result_t * result)
+{
+	const USBSim_Stats_t * usb = &result->usb;
+	// One frame is 1ms, so bytes per frame is kB/s.
+	double rate = (double)result->payload / usb->frames;
+	double copies = result->payload ? (double)usb->copy_bytes / result->payload : 0.0;
+
+	printf("%-22s %8.1f %8u %8u %8u %8u %6u %8.2f %6u %6u\n",
+			scenario->name, rate,
+			usb->out_packets, usb->in_packets, usb->out_naks + usb->in_naks,
+			result->cdc.rx_held_ms, usb->in_zlps, copies,
+			result->cdc.rx_dropped, result->errors);
+}
+
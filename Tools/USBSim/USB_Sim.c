@@ -0,0 +1,293 @@
+
+#include "USB_Sim.h"
+
+#include "usb/USB_EP.h"
+#include "usb/USB_CTL.h"
+#include "Core.h"
+#include "USB_Composite.h"
+#include "Updater.h"
+
+#include <stdlib.h>
+
+// Host side copies are not firmware work, and are not counted.
+#undef memcpy
+
+/*
+ * PRIVATE DEFINITIONS
+ */
+
+#define SIM_EP_COUNT				8
+#define SIM_EP_NUM(ep)				((ep) & 0x7F)
+#define SIM_EP_DIR(ep)				(((ep) & 0x80) ? 1 : 0)
+
+/*
+ * PRIVATE TYPES
+ */
+
+typedef struct {
+	bool open;
+	uint16_t size;
+	USB_EP_Callback_t callback;
+	// OUT endpoints are armed with a destination. IN endpoints hold a packet in the PMA.
+	bool ready;
+	uint8_t * dst;
+	uint32_t count;
+	uint8_t pma[USB_PACKET_SIZE];
+} SimEP_t;
+
+typedef struct {
+	uint8_t * rxData;
+	uint16_t rxSize;
+	void (*rxCallback)(void);
+	uint8_t * txData;
+	uint16_t txSize;
+	bool stalled;
+} SimCTL_t;
+
+/*
+ * PRIVATE PROTOTYPES
+ */
+
+static SimEP_t * USBSim_GetEP(uint8_t endpoint);
+
+/*
+ * PRIVATE VARIABLES
+ */
+
+USB_TypeDef gUSBSim_Regs;
+
+static SimEP_t gEP[SIM_EP_COUNT][2];
+static SimCTL_t gCTL;
+static USBSim_Stats_t gStats;
+static uint32_t gTick;
+
+/*
+ * PUBLIC FUNCTIONS
+ */
+
+void USBSim_Connect(void)
+{
+	bzero(gEP, sizeof(gEP));
+	USB_Composite_Init(1);
+}
+
+void USBSim_Disconnect(void)
+{
+	USB_Composite_Deinit();
+}
+
+bool USBSim_Control(const USB_SetupRequest_t * req, uint8_t * data)
+{
+	USB_SetupRequest_t setup = *req;
+	bzero(&gCTL, sizeof(gCTL));
+	USB_Composite_Setup(&setup);
+
+	if (gCTL.stalled)
+	{
+		return false;
+	}
+	if (req->bmRequest & 0x80)
+	{
+		if (gCTL.txData)
+		{
+			memcpy(data, gCTL.txData, gCTL.txSize);
+		}
+	}
+	else if (gCTL.rxCallback)
+	{
+		memcpy(gCTL.rxData, data, gCTL.rxSize);
+		gCTL.rxCallback();
+	}
+	return true;
+}
+
+bool USBSim_Out(uint8_t endpoint, const uint8_t * data, uint32_t count)
+{
+	SimEP_t * ep = USBSim_GetEP(endpoint);
+	if (!ep->open || !ep->ready)
+	{
+		gStats.out_naks++;
+		return false;
+	}
+
+	// The peripheral fills the PMA, then the firmware copies it out on completion.
+	memcpy(ep->pma, data, count);
+	if (count > ep->count)
+	{
+		count = ep->count;
+	}
+	memcpy(ep->dst, ep->pma, count);
+	gStats.copy_bytes += count;
+	gStats.out_packets++;
+	gStats.out_bytes += count;
+
+	ep->ready = false;
+	ep->callback(count);
+	return true;
+}
+
+int32_t USBSim_In(uint8_t endpoint, uint8_t * data)
+{
+	SimEP_t * ep = USBSim_GetEP(endpoint);
+	if (!ep->open || !ep->ready)
+	{
+		gStats.in_naks++;
+		return USBSIM_NAK;
+	}
+
+	uint32_t count = ep->count;
+	memcpy(data, ep->pma, count);
+	gStats.in_packets++;
+	gStats.in_bytes += count;
+	if (count == 0)
+	{
+		gStats.in_zlps++;
+	}
+
+	ep->ready = false;
+	ep->callback(count);
+	return count;
+}
+
+void USBSim_Frame(void)
+{
+	gStats.frames++;
+	gTick++;
+	USB->FNR = (USB->FNR + 1) & USB_FNR_FN;
+	// The driver passes SOF on to the class while it is enabled.
+	if (USB->CNTR & USB_CNTR_SOFM)
+	{
+		USB_Composite_SOF();
+	}
+}
+
+void USBSim_GetStats(USBSim_Stats_t * stats)
+{
+	*stats = gStats;
+}
+
+void USBSim_ResetStats(void)
+{
+	bzero(&gStats, sizeof(gStats));
+}
+
+void * USBSim_Memcpy(void * dst, const void * src, size_t size)
+{
+	gStats.copy_bytes += size;
+	return memcpy(dst, src, size);
+}
+
+/*
+ * STM32X STAND-INS
+ */
+
+void USB_EP_Open(uint8_t endpoint, uint8_t type, uint16_t size, USB_EP_Callback_t callback)
+{
+	SimEP_t * ep = USBSim_GetEP(endpoint);
+	bzero(ep, sizeof(SimEP_t));
+	ep->open = true;
+	ep->size = size;
+	ep->callback = callback;
+}
+
+void USB_EP_Close(uint8_t endpoint)
+{
+	USBSim_GetEP(endpoint)->open = false;
+}
+
+void USB_EP_Read(uint8_t endpoint, uint8_t * data, uint32_t count)
+{
+	SimEP_t * ep = USBSim_GetEP(endpoint);
+	ep->dst = data;
+	ep->count = count;
+	ep->ready = true;
+}
+
+void USB_EP_Write(uint8_t endpoint, const uint8_t * data, uint32_t count)
+{
+	SimEP_t * ep = USBSim_GetEP(endpoint);
+	if (count > ep->size)
+	{
+		count = ep->size;
+	}
+	// The packet is copied into the PMA immediately.
+	if (count > 0)
+	{
+		memcpy(ep->pma, data, count);
+		gStats.copy_bytes += count;
+	}
+	ep->count = count;
+	ep->ready = true;
+}
+
+void USB_EP_WriteZLP(uint8_t endpoint)
+{
+	USB_EP_Write(endpoint, NULL, 0);
+}
+
+void USB_CTL_Stall(void)
+{
+	gCTL.stalled = true;
+}
+
+void USB_CTL_Send(uint8_t * data, uint16_t size)
+{
+	gCTL.txData = data;
+	gCTL.txSize = size;
+}
+
+void USB_CTL_Receive(uint8_t * data, uint16_t size, void (*callback)(void))
+{
+	gCTL.rxData = data;
+	gCTL.rxSize = size;
+	gCTL.rxCallback = callback;
+}
+
+uint32_t CORE_GetTick(void)
+{
+	return gTick;
+}
+
+void CORE_Delay(uint32_t ms)
+{
+	gTick += ms;
+}
+
+void NVIC_SystemReset(void)
+{
+	abort();
+}
+
+/*
+ * FIRMWARE STAND-INS
+ */
+
+// Flash is not simulated. Downloads are accepted and discarded.
+void Updater_Begin(void)
+{
+}
+
+Updater_Status_t Updater_Write(uint32_t offset, const uint8_t * data, uint32_t size)
+{
+	return Updater_Status_Ok;
+}
+
+Updater_Status_t Updater_Finish(void)
+{
+	return Updater_Status_Ok;
+}
+
+Updater_Status_t Updater_GetInstallStatus(void)
+{
+	return Updater_Status_Ok;
+}
+
+/*
+ * PRIVATE FUNCTIONS
+ */
+
+static SimEP_t * USBSim_GetEP(uint8_t endpoint)
+{
+	return &gEP[SIM_EP_NUM(endpoint) % SIM_EP_COUNT][SIM_EP_DIR(endpoint)];
+}
+
@@ -0,0 +1,54 @@
+#ifndef USB_SIM_H
+#define USB_SIM_H
+
+#include "STM32X.h"
+#include "usb/USB_Defs.h"
+
+/*
+ * PUBLIC DEFINITIONS
+ */
+
+// A full speed frame fits at most 19 bulk packets of 64 bytes.
+#define USBSIM_SLOTS_PER_FRAME		19
+
+#define USBSIM_NAK					(-1)
+
+/*
+ * PUBLIC TYPES
+ */
+
+typedef struct {
+	uint32_t frames;
+	uint32_t out_packets;
+	uint32_t out_bytes;
+	uint32_t out_naks;
+	uint32_t in_packets;
+	uint32_t in_bytes;
+	uint32_t in_naks;
+	uint32_t in_zlps;
+	uint32_t copy_bytes;	// Bytes moved by firmware memcpy, and between PMA and RAM
+} USBSim_Stats_t;
+
+/*
+ * PUBLIC FUNCTIONS
+ */
+
+// Brings up the composite device, as the host would after enumeration.
+void USBSim_Connect(void);
+void USBSim_Disconnect(void);
+
+// Runs a control request against the class. Data is sent for OUT requests, and returned for IN requests.
+// Returns false if the class stalled the request.
+bool USBSim_Control(const USB_SetupRequest_t * req, uint8_t * data);
+
+// Host transactions. These NAK if the endpoint is not ready.
+bool USBSim_Out(uint8_t endpoint, const uint8_t * data, uint32_t count);
+int32_t USBSim_In(uint8_t endpoint, uint8_t * data);
+
+// Ends the current frame, and issues an SOF.
+void USBSim_Frame(void);
+
+void USBSim_GetStats(USBSim_Stats_t * stats);
+void USBSim_ResetStats(void);
+
+#endif // USB_SIM_H
@@ -0,0 +1,14 @@
+#ifndef CORE_H
+#define CORE_H
+
+#include "STM32X.h"
+
+/*
+ * PUBLIC FUNCTIONS
+ */
+
+// The tick follows the simulated USB frames.
+uint32_t CORE_GetTick(void);
+void CORE_Delay(uint32_t ms);
+
+#endif // CORE_H
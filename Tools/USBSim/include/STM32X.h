@@ -0,0 +1,68 @@
+#ifndef STM32X_H
+#define STM32X_H
+
+// Host stand-in for the STM32X library, used by the USB simulator.
+// Only the parts needed by the USB class drivers are provided.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+
+#include "Board.h"
+
+/*
+ * PUBLIC DEFINITIONS
+ */
+
+#define LENGTH(x)			(sizeof(x)/sizeof(*(x)))
+#define LOBYTE(x)			((uint8_t)((x) & 0x00FFU))
+#define HIBYTE(x)			((uint8_t)(((x) & 0xFF00U) >> 8U))
+
+#define __ALIGNED(x)		__attribute__((aligned(x)))
+
+// The simulator is single threaded. Endpoint callbacks only run from the host transactions.
+#define __disable_irq()
+#define __enable_irq()
+#define __get_PRIMASK()		0U
+#define __set_PRIMASK(x)	((void)(x))
+
+#define USB_CNTR_SOFM		((uint16_t)0x0200U)
+#define USB_CNTR_RESUME		((uint16_t)0x0010U)
+#define USB_CNTR_FSUSP		((uint16_t)0x0008U)
+#define USB_CNTR_LPMODE		((uint16_t)0x0004U)
+#define USB_FNR_FN			((uint16_t)0x07FFU)
+
+#define USB					(&gUSBSim_Regs)
+
+// Firmware copies are counted, so the benchmark can report copies per byte.
+#define memcpy(dst, src, size)	USBSim_Memcpy(dst, src, size)
+
+/*
+ * PUBLIC TYPES
+ */
+
+typedef void(*VoidFunction_t)(void);
+typedef int IRQn_Type;
+
+typedef struct {
+	volatile uint16_t CNTR;
+	volatile uint16_t FNR;
+} USB_TypeDef;
+
+/*
+ * PUBLIC FUNCTIONS
+ */
+
+void * USBSim_Memcpy(void * dst, const void * src, size_t size);
+
+void NVIC_SystemReset(void);
+
+/*
+ * EXTERN DECLARATIONS
+ */
+
+extern USB_TypeDef gUSBSim_Regs;
+
+#endif // STM32X_H
@@ -0,0 +1,14 @@
+#ifndef USB_CTL_H
+#define USB_CTL_H
+
+#include "usb/USB_Defs.h"
+
+/*
+ * PUBLIC FUNCTIONS
+ */
+
+void USB_CTL_Send(uint8_t * data, uint16_t size);
+void USB_CTL_Receive(uint8_t * data, uint16_t size, void (*callback)(void));
+void USB_CTL_Stall(void);
+
+#endif // USB_CTL_H
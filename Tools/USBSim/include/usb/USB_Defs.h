@@ -0,0 +1,36 @@
+#ifndef USB_DEFS_H
+#define USB_DEFS_H
+
+#include "STM32X.h"
+
+/*
+ * PUBLIC DEFINITIONS
+ */
+
+#define USB_PACKET_SIZE		64
+
+#define USB_DESCR_BLOCK_CONFIGURATION(_size, _interfaces, _config) \
+	0x09, 0x02, LOBYTE(_size), HIBYTE(_size), (_interfaces), (_config), 0x00, 0xC0, 0x32
+
+#define USB_DESC_BLOCK_INTERFACE_ASSOCIATION(_first, _count, _class, _subclass, _protocol) \
+	0x08, 0x0B, (_first), (_count), (_class), (_subclass), (_protocol), 0x00
+
+#define USB_DESCR_BLOCK_INTERFACE(_interface, _endpoints, _class, _subclass, _protocol) \
+	0x09, 0x04, (_interface), 0x00, (_endpoints), (_class), (_subclass), (_protocol), 0x00
+
+#define USB_DESCR_BLOCK_ENDPOINT(_address, _type, _size, _interval) \
+	0x07, 0x05, (_address), (_type), LOBYTE(_size), HIBYTE(_size), (_interval)
+
+/*
+ * PUBLIC TYPES
+ */
+
+typedef struct {
+	uint8_t bmRequest;
+	uint8_t bRequest;
+	uint16_t wValue;
+	uint16_t wIndex;
+	uint16_t wLength;
+} USB_SetupRequest_t;
+
+#endif // USB_DEFS_H
@@ -0,0 +1,31 @@
+#ifndef USB_EP_H
+#define USB_EP_H
+
+#include "usb/USB_Defs.h"
+
+/*
+ * PUBLIC DEFINITIONS
+ */
+
+#define USB_EP_TYPE_CTRL	0
+#define USB_EP_TYPE_ISOC	1
+#define USB_EP_TYPE_BULK	2
+#define USB_EP_TYPE_INTR	3
+
+/*
+ * PUBLIC TYPES
+ */
+
+typedef void(*USB_EP_Callback_t)(uint32_t count);
+
+/*
+ * PUBLIC FUNCTIONS
+ */
+
+void USB_EP_Open(uint8_t endpoint, uint8_t type, uint16_t size, USB_EP_Callback_t callback);
+void USB_EP_Close(uint8_t endpoint);
+void USB_EP_Read(uint8_t endpoint, uint8_t * data, uint32_t count);
+void USB_EP_Write(uint8_t endpoint, const uint8_t * data, uint32_t count);
+void USB_EP_WriteZLP(uint8_t endpoint);
+
+#endif // USB_EP_H